@@ -35,7 +35,7 @@
 #include "xmalloc.h"
 
 static void
-connect_fds(int pty_fd, int pipe_out, int pipe_err)
+connect_fds(int pty_fd, int pipe_in, int pipe_out, int pipe_err)
 {
 	if (setsid() < 0)
 		error(EXIT_FAILURE, errno, "setsid");
@@ -48,6 +48,12 @@ connect_fds(int pty_fd, int pipe_out, int pipe_err)
 		if (dup2(pty_fd, STDIN_FILENO) < 0)
 			error(EXIT_FAILURE, errno, "dup2(%d, %d)",
 			      pty_fd, STDIN_FILENO);
+	} else if (pipe_in >= 0)
+	{
+		/* stdin is fed by the parent */
+		if (dup2(pipe_in, STDIN_FILENO) < 0)
+			error(EXIT_FAILURE, errno, "dup2(%d, %d)",
+			      pipe_in, STDIN_FILENO);
 	} else
 	{
 		/* redirect stdin to /dev/null if and only if
@@ -55,15 +61,22 @@ connect_fds(int pty_fd, int pipe_out, int pipe_err)
 		if (isatty(STDIN_FILENO))
 			nullify_stdin();
 	}
-	if (dup2((use_pty ? pty_fd : pipe_out), STDOUT_FILENO) < 0)
+
+	/* Output goes to the pipes if there are any, otherwise to pty. */
+	int     out_fd = pipe_out < 0 ? pty_fd : pipe_out;
+	int     err_fd = pipe_err < 0 ? pty_fd : pipe_err;
+
+	if (dup2(out_fd, STDOUT_FILENO) < 0)
 		error(EXIT_FAILURE, errno, "dup2(%d, %d)",
-		      (use_pty ? pty_fd : pipe_out), STDOUT_FILENO);
-	if (dup2((use_pty ? pty_fd : pipe_err), STDERR_FILENO) < 0)
+		      out_fd, STDOUT_FILENO);
+	if (dup2(err_fd, STDERR_FILENO) < 0)
 		error(EXIT_FAILURE, errno, "dup2(%d, %d)",
-		      (use_pty ? pty_fd : pipe_err), STDERR_FILENO);
+		      err_fd, STDERR_FILENO);
 
 	if (pty_fd > STDERR_FILENO)
 		close(pty_fd);
+	if (pipe_in > STDERR_FILENO)
+		close(pipe_in);
 	if (pipe_out > STDERR_FILENO)
 		close(pipe_out);
 	if (pipe_err > STDERR_FILENO)
@@ -162,8 +175,8 @@ xauth_add_entry(char *const *env)
 }
 
 void
-handle_child(char *const *env, int pty_fd, int pipe_out, int pipe_err,
-	     int ctl_fd)
+handle_child(char *const *env, int pty_fd, int pipe_in, int pipe_out,
+	     int pipe_err, int ctl_fd)
 {
 	if (x11_key)
 	{
@@ -172,7 +185,7 @@ handle_child(char *const *env, int pty_fd, int pipe_out, int pipe_err,
 		free((char *) x11_key);
 		x11_key = 0;
 	}
-	connect_fds(pty_fd, pipe_out, pipe_err);
+	connect_fds(pty_fd, pipe_in, pipe_out, pipe_err);
 
 	dfl_signal_handler(SIGHUP);
 	dfl_signal_handler(SIGPIPE);
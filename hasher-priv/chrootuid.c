@@ -25,11 +25,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <signal.h>
 #include <time.h>
 #include <pwd.h>
 #include <grp.h>
 #include <pty.h>
+#include <sys/prctl.h>
 #include <sys/socket.h>
 
 #include "priv.h"
@@ -81,7 +83,9 @@ chrootuid(uid_t uid, gid_t gid, const char *ehome,
 	int     master = -1, slave = -1;
 	int     pipe_out[2] = { -1, -1 };
 	int     pipe_err[2] = { -1, -1 };
+	int     pipe_in[2] = { -1, -1 };
 	int     ctl[2] = { -1, -1 };
+	int     kill_fd, feed_fd = -1;
 	pid_t   pid;
 
 	error_print_progname = print_program_subname;
@@ -100,10 +104,46 @@ chrootuid(uid_t uid, gid_t gid, const char *ehome,
 	/* Check and sanitize file descriptors again. */
 	sanitize_fds();
 
-	/* Create pipes only if use_pty is not set. */
-	if (!use_pty && (pipe(pipe_out) || pipe(pipe_err)))
+	/* Open files while the caller file system is visible. */
+	transcript_open();
+	stats_open();
+
+	/* The parent is not allowed to kill the child, the helper is. */
+	kill_fd = killuid_helper(uid, gid);
+
+	/* Let orphaned descendants of the child be reaped by the parent. */
+	if (prctl(PR_SET_CHILD_SUBREAPER, 1UL, 0UL, 0UL, 0UL) < 0)
+		error(EXIT_FAILURE, errno, "prctl PR_SET_CHILD_SUBREAPER");
+
+	/* Observers connect from the caller side, see observe.c. */
+	observe_open();
+
+	/* The stdin feed is read by the parent and piped to the child. */
+	if (stdin_feed)
+	{
+		feed_fd = stdin_feed[0] == '/' ?
+			caller_open(stdin_feed, O_RDONLY) : STDIN_FILENO;
+		if (pipe(pipe_in))
+			error(EXIT_FAILURE, errno, "pipe");
+		(void) fcntl(pipe_in[1], F_SETPIPE_SZ, (int) relay_bufsize_max);
+	}
+
+	/*
+	 * Create output pipes unless all output goes to the pty,
+	 * that is, unless use_pty is set without use_pty_stdin.
+	 */
+	int     use_pipes = !use_pty || use_pty_stdin;
+
+	if (use_pipes && (pipe(pipe_out) || pipe(pipe_err)))
 		error(EXIT_FAILURE, errno, "pipe");
 
+	/* Let the child get ahead of the relay by up to its buffer size. */
+	if (use_pipes)
+	{
+		(void) fcntl(pipe_out[0], F_SETPIPE_SZ, (int) relay_bufsize_max);
+		(void) fcntl(pipe_err[0], F_SETPIPE_SZ, (int) relay_bufsize_max);
+	}
+
 	/* Always create pty, necessary for ioctl TIOCSCTTY in the child. */
 	if (openpty(&master, &slave, 0, 0, 0) < 0)
 		error(EXIT_FAILURE, errno, "openpty");
@@ -139,7 +179,8 @@ chrootuid(uid_t uid, gid_t gid, const char *ehome,
 		program_subname = "master";
 
 		if (close(slave)
-		    || (!use_pty
+		    || (stdin_feed && close(pipe_in[0]))
+		    || (use_pipes
 			&& (close(pipe_out[1]) || close(pipe_err[1])))
 		    || (x11_display && close(ctl[1])))
 			error(EXIT_FAILURE, errno, "close");
@@ -152,14 +193,17 @@ chrootuid(uid_t uid, gid_t gid, const char *ehome,
 
 		/* Process is no longer privileged at this point. */
 
-		return handle_parent(pid, master, pipe_out[0], pipe_err[0],
-				     ctl[0]);
+		return handle_parent(pid, master, pipe_in[1], pipe_out[0],
+				     pipe_err[0], feed_fd, ctl[0], kill_fd);
 	} else
 	{
 		program_subname = "slave";
 
-		if (close(master)
-		    || (!use_pty
+		if (close(master) || close(kill_fd)
+		    || (stdin_feed && (close(pipe_in[1])
+				       || (feed_fd > STDERR_FILENO
+					   && close(feed_fd))))
+		    || (use_pipes
 			&& (close(pipe_out[0]) || close(pipe_err[0])))
 		    || (x11_display && close(ctl[0])))
 			error(EXIT_FAILURE, errno, "close");
@@ -184,7 +228,7 @@ chrootuid(uid_t uid, gid_t gid, const char *ehome,
 			"SHELL=/bin/sh", 0
 		};
 
-		handle_child((char *const *) env, slave,
+		handle_child((char *const *) env, slave, pipe_in[0],
 				    pipe_out[1], pipe_err[1], ctl[1]);
 	}
 }
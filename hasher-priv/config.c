@@ -30,6 +30,7 @@
 #include <unistd.h>
 #include <limits.h>
 #include <pwd.h>
+#include <syslog.h>
 
 #include "priv.h"
 #include "xmalloc.h"
@@ -41,11 +42,27 @@ const char *requested_mountpoints;
 const char *change_user1, *change_user2;
 const char *term;
 const char *x11_display, *x11_key;
+const char *transcript_path;
+const char *stdin_feed;
+const char *observe_socket;
 uid_t   change_uid1, change_uid2;
 gid_t   change_gid1, change_gid2;
 mode_t  change_umask = 022;
 int change_nice = 8;
-int     allow_tty_devices, use_pty;
+int     allow_tty_devices, use_pty, use_pty_stdin;
+int     transcript_compress;
+int     transcript_index;
+int     relay_thread;
+int     log_dgram = 1;
+int     log_priority = LOG_DEBUG;
+int     log_keep_filtered;
+int     journal_socket;
+const char *journal_fields;
+int     framed_output;
+int     quiet_output, quiet_spool;
+size_t  quiet_tail_size = QUIET_TAIL_SIZE;
+const char *relay_stats_dest;
+int     relay_stats_json;
 size_t  x11_data_len;
 int share_caller_network = 0;
 int share_ipc = -1;
@@ -112,6 +129,11 @@ change_rlimit_t change_rlimit[] = {
 };
 
 work_limit_t wlimit;
+size_t  relay_bufsize_max = RELAY_BUFSIZE_MAX;
+size_t  output_queue_size = OUTPUT_QUEUE_SIZE;
+unsigned long exit_grace_time = 1000;
+unsigned long coalesce_time;
+unsigned long log_rate, log_burst;
 
 static void __attribute__ ((noreturn))
 bad_option_name(const char *optname, const char *filename)
@@ -235,11 +257,40 @@ str2wlim(const char *name, const char *value, const char *filename)
 	return (unsigned long) n;
 }
 
+/* Time limits are in seconds, or in milliseconds with "ms" suffix. */
+static unsigned long
+str2wlim_ms(const char *name, const char *value, const char *filename)
+{
+	char   *p = 0;
+	unsigned long long n;
+
+	if (!*value)
+		bad_option_value(name, value, filename);
+
+	errno = 0;
+	n = strtoull(value, &p, 10);
+	if (!p || p == value || (n == ULLONG_MAX && errno == ERANGE))
+		bad_option_value(name, value, filename);
+
+	if (!*p || !strcasecmp(p, "s"))
+	{
+		if (n > ULONG_MAX / 1000)
+			bad_option_value(name, value, filename);
+		n *= 1000;
+	} else if (strcasecmp(p, "ms") || n > ULONG_MAX)
+		bad_option_value(name, value, filename);
+
+	return (unsigned long) n;
+}
+
 static void
 modify_wlim(unsigned long *pval, const char *value,
 	    const char *optname, const char *filename, int is_system)
 {
-	unsigned long val = str2wlim(optname, value, filename);
+	unsigned long val =
+		(pval == &wlimit.time_elapsed || pval == &wlimit.time_idle) ?
+		str2wlim_ms(optname, value, filename) :
+		str2wlim(optname, value, filename);
 
 	if (is_system || *pval == 0 || (val > 0 && val < *pval))
 		*pval = val;
@@ -255,14 +306,50 @@ parse_wlim(const char *name, const char *value,
 		pval = &wlimit.time_elapsed;
 	else if (!strcasecmp("time_idle", name))
 		pval = &wlimit.time_idle;
+	else if (!strcasecmp("bytes_read", name))
+		pval = &wlimit.bytes_read;
 	else if (!strcasecmp("bytes_written", name))
 		pval = &wlimit.bytes_written;
+	else if (!strcasecmp("rate_bytes", name))
+		pval = &wlimit.rate_bytes;
+	else if (!strcasecmp("rate_burst", name))
+		pval = &wlimit.rate_burst;
 	else
 		bad_option_name(optname, filename);
 
 	modify_wlim(pval, value, optname, filename, 1);
 }
 
+/* Syslog severity, by name or number. */
+static int
+str2priority(const char *name, const char *value, const char *filename)
+{
+	static const char *const names[] = {
+		"emerg", "alert", "crit", "err",
+		"warning", "notice", "info", "debug"
+	};
+	int     i;
+
+	for (i = 0; i < (int) (sizeof(names) / sizeof(names[0])); ++i)
+		if (!strcasecmp(value, names[i])
+		    || (value[0] == '0' + i && !value[1]))
+			return i;
+
+	bad_option_value(name, value, filename);
+	return LOG_DEBUG;
+}
+
+static size_t
+str2bufsize(const char *name, const char *value, const char *filename)
+{
+	unsigned long n = str2wlim(name, value, filename);
+
+	if (n < RELAY_BUFSIZE_MIN || n > (1UL << 30))
+		bad_option_value(name, value, filename);
+
+	return (size_t) n;
+}
+
 static const char *
 parse_mountpoints(const char *value, const char *filename)
 {
@@ -386,6 +473,37 @@ set_config(const char *name, const char *value, const char *filename)
 	else if (!strncasecmp(rlim_prefix, name, sizeof(rlim_prefix) - 1))
 		parse_rlim(name + sizeof(rlim_prefix) - 1, value, name,
 			   filename);
+	else if (!strcasecmp("transcript_compress", name))
+		transcript_compress = str2bool(name, value, filename);
+	else if (!strcasecmp("relay_thread", name))
+		relay_thread = str2bool(name, value, filename);
+	else if (!strcasecmp("log_dgram", name))
+		log_dgram = str2bool(name, value, filename);
+	else if (!strcasecmp("log_priority", name))
+		log_priority = str2priority(name, value, filename);
+	else if (!strcasecmp("log_keep_filtered", name))
+		log_keep_filtered = str2bool(name, value, filename);
+	else if (!strcasecmp("log_rate", name))
+		log_rate = str2wlim(name, value, filename);
+	else if (!strcasecmp("log_burst", name))
+		log_burst = str2wlim(name, value, filename);
+	else if (!strcasecmp("journal_socket", name))
+		journal_socket = str2bool(name, value, filename);
+	else if (!strcasecmp("journal_fields", name))
+	{
+		free((char *) journal_fields);
+		journal_fields = *value ? xstrdup(value) : 0;
+	}
+	else if (!strcasecmp("quiet_tail_size", name))
+		quiet_tail_size = str2bufsize(name, value, filename);
+	else if (!strcasecmp("relay_bufsize_max", name))
+		relay_bufsize_max = str2bufsize(name, value, filename);
+	else if (!strcasecmp("output_queue_size", name))
+		output_queue_size = str2bufsize(name, value, filename);
+	else if (!strcasecmp("exit_grace_time", name))
+		exit_grace_time = str2wlim_ms(name, value, filename);
+	else if (!strcasecmp("coalesce_time", name))
+		coalesce_time = str2wlim_ms(name, value, filename);
 	else if (!strncasecmp(wlim_prefix, name, sizeof(wlim_prefix) - 1))
 		parse_wlim(name + sizeof(wlim_prefix) - 1, value, name,
 			   filename);
@@ -520,6 +638,54 @@ check_user(const char *user_name, uid_t * user_uid, gid_t * user_gid,
 		      user_name);
 }
 
+/*
+ * Environment values which may only tighten the configuration,
+ * see parse_env().
+ */
+static const char *env_coalesce_time;
+static const char *env_log_priority, *env_log_rate, *env_log_burst;
+static int env_journal_off;
+
+static void
+tighten_config(void)
+{
+	/* The configured coalesce_time is the maximum. */
+	if (env_coalesce_time)
+	{
+		unsigned long val = str2wlim_ms("coalesce_time",
+						env_coalesce_time,
+						"environment");
+
+		if (val < coalesce_time)
+			coalesce_time = val;
+	}
+
+	if (env_log_priority)
+	{
+		int     priority = str2priority("log_priority",
+						env_log_priority,
+						"environment");
+
+		if (priority < log_priority)
+			log_priority = priority;
+	}
+
+	/* log_burst defaults to log_rate, which is its limit then. */
+	if (log_rate && !log_burst)
+		log_burst = log_rate;
+
+	if (env_log_rate)
+		modify_wlim(&log_rate, env_log_rate, "log_rate",
+			    "environment", 0);
+
+	if (env_log_burst)
+		modify_wlim(&log_burst, env_log_burst, "log_burst",
+			    "environment", 0);
+
+	if (env_journal_off)
+		journal_socket = 0;
+}
+
 void
 configure(void)
 {
@@ -561,6 +727,8 @@ configure(void)
 	if (change_gid1 == change_gid2)
 		error(EXIT_FAILURE, 0,
 		      "config: gid of user1 coincides with gid of user2");
+
+	tighten_config();
 }
 
 void
@@ -576,16 +744,134 @@ parse_env(void)
 		modify_wlim(&wlimit.time_idle, e, "wlimit_time_idle",
 			    "environment", 0);
 
+	if ((e = getenv("wlimit_bytes_read")) && *e)
+		modify_wlim(&wlimit.bytes_read, e, "wlimit_bytes_read",
+			    "environment", 0);
+
 	if ((e = getenv("wlimit_bytes_written")) && *e)
 		modify_wlim(&wlimit.bytes_written, e, "wlimit_bytes_written",
 			    "environment", 0);
 
+	if ((e = getenv("wlimit_rate_bytes")) && *e)
+		modify_wlim(&wlimit.rate_bytes, e, "wlimit_rate_bytes",
+			    "environment", 0);
+
+	if ((e = getenv("wlimit_rate_burst")) && *e)
+		modify_wlim(&wlimit.rate_burst, e, "wlimit_rate_burst",
+			    "environment", 0);
+
+	if ((e = getenv("coalesce_time")) && *e)
+		env_coalesce_time = xstrdup(e);
+
 	if ((e = getenv("use_pty")))
 		use_pty = str2bool("use_pty", e, "environment");
 
+	if ((e = getenv("use_pty_stdin")))
+		use_pty_stdin = str2bool("use_pty_stdin", e, "environment");
+
+	/* The pty is still the controlling terminal and stdin of the child. */
+	if (use_pty_stdin)
+		use_pty = 1;
+
+	if ((e = getenv("framed_output")))
+		framed_output = str2bool("framed_output", e, "environment");
+
+	if ((e = getenv("quiet_output")))
+		quiet_output = str2bool("quiet_output", e, "environment");
+
+	if ((e = getenv("quiet_spool")))
+		quiet_spool = str2bool("quiet_spool", e, "environment");
+
+	if ((e = getenv("relay_stats")) && *e)
+	{
+		if (strcmp(e, "1") && strcmp(e, "2") && *e != '/')
+			error(EXIT_FAILURE, 0,
+			      "relay_stats: %s: descriptor 1 or 2, or absolute path required",
+			      e);
+		relay_stats_dest = xstrdup(e);
+	}
+
+	if ((e = getenv("relay_stats_format")) && *e)
+	{
+		if (!strcasecmp(e, "json"))
+			relay_stats_json = 1;
+		else if (strcasecmp(e, "text"))
+			bad_option_value("relay_stats_format", e,
+					 "environment");
+	}
+
+	/* In hybrid mode, child output still comes through pipes. */
+	if (use_pty && !use_pty_stdin && framed_output)
+		error(EXIT_FAILURE, 0,
+		      "framed_output cannot be used together with use_pty");
+
+	/* The report would get in between the frames. */
+	if (framed_output && relay_stats_dest && !strcmp(relay_stats_dest, "1"))
+		error(EXIT_FAILURE, 0,
+		      "relay_stats=1 cannot be used together with framed_output");
+
+	if ((e = getenv("stdin_feed")) && *e)
+	{
+		if (strcmp(e, "0") && *e != '/')
+			error(EXIT_FAILURE, 0,
+			      "stdin_feed: %s: descriptor 0 or absolute path required",
+			      e);
+		if (use_pty)
+			error(EXIT_FAILURE, 0,
+			      "stdin_feed cannot be used together with use_pty");
+		stdin_feed = xstrdup(e);
+	}
+
 	if (use_pty && (e = getenv("TERM")) && *e)
 		term = xstrdup(e);
 
+	if ((e = getenv("transcript")) && *e)
+	{
+		if (*e != '/')
+			error(EXIT_FAILURE, 0,
+			      "transcript: %s: absolute path required", e);
+		transcript_path = xstrdup(e);
+	}
+
+	if ((e = getenv("observe_socket")) && *e)
+	{
+		if (*e != '/')
+			error(EXIT_FAILURE, 0,
+			      "observe_socket: %s: absolute path required", e);
+		observe_socket = xstrdup(e);
+	}
+
+	if ((e = getenv("transcript_compress")))
+		transcript_compress =
+			str2bool("transcript_compress", e, "environment");
+
+	if ((e = getenv("transcript_index")))
+		transcript_index =
+			str2bool("transcript_index", e, "environment");
+
+	/* Applied once the configuration is loaded, see tighten_config(). */
+	if ((e = getenv("log_priority")) && *e)
+		env_log_priority = xstrdup(e);
+
+	if ((e = getenv("log_keep_filtered")))
+		log_keep_filtered =
+			str2bool("log_keep_filtered", e, "environment");
+
+	if ((e = getenv("log_rate")) && *e)
+		env_log_rate = xstrdup(e);
+
+	if ((e = getenv("log_burst")) && *e)
+		env_log_burst = xstrdup(e);
+
+	if ((e = getenv("journal_socket")))
+		env_journal_off = !str2bool("journal_socket", e, "environment");
+
+	if ((e = getenv("journal_fields")))
+	{
+		free((char *) journal_fields);
+		journal_fields = *e ? xstrdup(e) : 0;
+	}
+
 	if ((e = getenv("XAUTH_DISPLAY")) && *e)
 		x11_display = xstrdup(e);
 
@@ -0,0 +1,261 @@
+/*
+  Copyright (C) 2026  agent <agent@local>
+
+  The chrootuid parent event engine for the hasher-priv program.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Code in this file may be executed with caller privileges. */
+
+/*
+ * Descriptors are registered once, edge-triggered, for both directions.
+ * Readiness reported by the kernel is latched in ev_watch.ready and
+ * stays there until the handler observes EAGAIN or a short transfer
+ * and clears it.  A handler which stops early while its descriptor
+ * is still ready asks to be called again using ev_pend().
+ *
+ * The engine state is per thread, so that a thread may run an event
+ * loop of its own; watches are only used by the thread which added them.
+ */
+
+#include <errno.h>
+#include <error.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#include "priv.h"
+#include "xmalloc.h"
+
+#define EV_MAX_EVENTS	64
+
+static __thread int ev_fd = -1;
+static __thread size_t ev_count;	/* watches interested in input */
+
+static __thread struct epoll_event ev_events[EV_MAX_EVENTS];
+static __thread int ev_nevents, ev_next;
+
+static __thread ev_watch_t *ev_pending;
+static __thread size_t ev_npending, ev_pending_size;
+
+void
+ev_init(void)
+{
+	if ((ev_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+		error(EXIT_FAILURE, errno, "epoll_create1");
+}
+
+/* Release the engine, watches are not to be polled any longer. */
+void
+ev_fini(void)
+{
+	if (ev_fd >= 0)
+		(void) close(ev_fd);
+	ev_fd = -1;
+}
+
+/* Return nonzero if the descriptor is polled, zero if it is always ready. */
+static int
+ev_register(ev_watch_t w)
+{
+	struct epoll_event ev;
+
+	if (ev_fd < 0)
+		return 0;
+
+	ev.events = EPOLLET;
+	if (w->events & EV_READ)
+		ev.events |= EPOLLIN | EPOLLRDHUP;
+	if (w->events & EV_WRITE)
+		ev.events |= EPOLLOUT;
+	ev.data.ptr = w;
+	if (epoll_ctl(ev_fd, EPOLL_CTL_ADD, w->fd, &ev) == 0)
+		return 1;
+	if (errno != EPERM)
+		error(EXIT_FAILURE, errno, "epoll_ctl ADD %d", w->fd);
+	return 0;
+}
+
+static void
+ev_unregister(ev_watch_t w)
+{
+	if (ev_fd >= 0 && epoll_ctl(ev_fd, EPOLL_CTL_DEL, w->fd, 0) < 0)
+		error(EXIT_FAILURE, errno, "epoll_ctl DEL %d", w->fd);
+}
+
+void
+ev_add(ev_watch_t w, int fd, unsigned events, ev_handler_t handler,
+       void *data)
+{
+	w->fd = fd;
+	w->events = events;
+	w->ready = 0;
+	w->pending = 0;
+	w->polled = 0;
+	w->handler = handler;
+	w->data = data;
+
+	if (fd < 0)
+		return;
+
+	if (ev_register(w))
+		w->polled = 1;
+	else
+	{
+		/* Regular files and the like are always ready. */
+		w->ready = events;
+		ev_pend(w);
+	}
+
+	if ((events & (EV_READ | EV_AUX)) == EV_READ)
+		++ev_count;
+}
+
+void
+ev_del(ev_watch_t w)
+{
+	size_t  i;
+	int     j;
+
+	if (w->fd < 0)
+		return;
+
+	if (w->polled)
+		ev_unregister(w);
+
+	/* Forget events not yet dispatched for this watch. */
+	for (j = ev_next; j < ev_nevents; ++j)
+		if (ev_events[j].data.ptr == w)
+			ev_events[j].data.ptr = 0;
+
+	for (i = 0; i < ev_npending; ++i)
+		if (ev_pending[i] == w)
+			ev_pending[i] = 0;
+
+	w->fd = -1;
+	w->ready = 0;
+	w->pending = 0;
+	w->polled = 0;
+	if ((w->events & (EV_READ | EV_AUX)) == EV_READ)
+		--ev_count;
+}
+
+size_t
+ev_input_count(void)
+{
+	return ev_count;
+}
+
+void
+ev_pend(ev_watch_t w)
+{
+	if (w->pending || w->fd < 0)
+		return;
+
+	if (ev_npending == ev_pending_size)
+	{
+		ev_pending_size = ev_pending_size ? 2 * ev_pending_size : 16;
+		ev_pending = xrealloc(ev_pending, ev_pending_size,
+				      sizeof(*ev_pending));
+	}
+	ev_pending[ev_npending++] = w;
+	w->pending = 1;
+}
+
+/*
+ * Update read readiness after a read of SIZE bytes returned N.
+ * A short read drains the descriptor unless the peer has hung up,
+ * in which case the end of file is yet to be read.
+ */
+void
+ev_read_done(ev_watch_t w, ssize_t n, size_t size)
+{
+	if (n < 0 ? errno == EAGAIN
+	    : ((size_t) n < size && !(w->ready & EV_HUP)))
+		w->ready &= ~EV_READ;
+}
+
+/* Update write readiness after a write of SIZE bytes returned N. */
+void
+ev_write_done(ev_watch_t w, ssize_t n, size_t size)
+{
+	if (n < 0 ? errno == EAGAIN : (size_t) n < size)
+		w->ready &= ~EV_WRITE;
+}
+
+/*
+ * Wait for events, the timeout is in milliseconds, negative means forever.
+ * Return the number of events plus pending watches, 0 on timeout.
+ */
+int
+ev_poll(int timeout)
+{
+	int     rc;
+
+	ev_nevents = ev_next = 0;
+	rc = epoll_wait(ev_fd, ev_events, EV_MAX_EVENTS,
+			ev_npending ? 0 : timeout);
+	if (rc < 0)
+		return rc;
+
+	ev_nevents = rc;
+	return rc + (int) ev_npending;
+}
+
+static void
+ev_call(ev_watch_t w)
+{
+	if (w->fd >= 0 && w->handler)
+		w->handler(w);
+}
+
+void
+ev_dispatch(void)
+{
+	ev_watch_t w;
+	size_t  i, n;
+
+	while (ev_next < ev_nevents)
+	{
+		struct epoll_event *ev = &ev_events[ev_next++];
+
+		if (!(w = ev->data.ptr))
+			continue;
+
+		if (ev->events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+			w->ready |= EV_READ;
+		if (ev->events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+			w->ready |= EV_HUP;
+		if (ev->events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+			w->ready |= EV_WRITE;
+
+		ev_call(w);
+	}
+
+	/* Watches pended by these very handlers are left for the next round. */
+	n = ev_npending;
+	for (i = 0; i < n; ++i)
+	{
+		if (!(w = ev_pending[i]))
+			continue;
+		ev_pending[i] = 0;
+		w->pending = 0;
+		ev_call(w);
+	}
+
+	for (i = n; i < ev_npending; ++i)
+		ev_pending[i - n] = ev_pending[i];
+	ev_npending -= n;
+}
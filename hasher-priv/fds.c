@@ -25,7 +25,12 @@
 #include <fcntl.h>
 #include <paths.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <grp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <linux/limits.h>
 #include <limits.h>
 
@@ -75,6 +80,31 @@ sanitize_fds(void)
 	errno = 0;
 }
 
+/*
+ * Close all descriptors but KEEP_FD, standard descriptors are
+ * redirected to /dev/null.
+ * This function may be executed with root privileges.
+ */
+void
+close_fds_except(int keep_fd)
+{
+	int     fd, null_fd, max_fd = get_open_max();
+
+	if ((null_fd = open(_PATH_DEVNULL, O_RDWR)) < 0)
+		error(EXIT_FAILURE, errno, "open: %s", _PATH_DEVNULL);
+
+	for (fd = STDIN_FILENO; fd <= STDERR_FILENO; ++fd)
+		if (fd != null_fd && dup2(null_fd, fd) != fd)
+			error(EXIT_FAILURE, errno, "dup2(%d, %d)",
+			      null_fd, fd);
+
+	for (; fd < max_fd; ++fd)
+		if (fd != keep_fd)
+			(void) close(fd);
+
+	errno = 0;
+}
+
 /* This function may be executed with root privileges. */
 void
 cloexec_fds(void)
@@ -98,6 +128,90 @@ cloexec_fds(void)
 	errno = 0;
 }
 
+/*
+ * Files and sockets of the caller are created with caller credentials,
+ * temporary changing them like chdiruid() does.
+ */
+
+/* This function may be executed with root privileges. */
+static void
+caller_creds_set(uid_t *saved_uid, gid_t *saved_gid)
+{
+#ifdef ENABLE_SUPPLEMENTARY_GROUPS
+	if (initgroups(caller_user, caller_gid) < 0)
+		error(EXIT_FAILURE, errno, "caller_open: initgroups: %s",
+		      caller_user);
+#endif /* ENABLE_SUPPLEMENTARY_GROUPS */
+	ch_gid(caller_gid, saved_gid);
+	ch_uid(caller_uid, saved_uid);
+}
+
+/* This function may be executed with root privileges. */
+static void
+caller_creds_restore(uid_t saved_uid, gid_t saved_gid)
+{
+	ch_uid(saved_uid, 0);
+	ch_gid(saved_gid, 0);
+#ifdef ENABLE_SUPPLEMENTARY_GROUPS
+	if (setgroups(0UL, 0) < 0)
+		error(EXIT_FAILURE, errno, "caller_open: setgroups");
+#endif /* ENABLE_SUPPLEMENTARY_GROUPS */
+}
+
+/* This function may be executed with root privileges. */
+int
+caller_open(const char *path, int flags)
+{
+	uid_t   saved_uid = (uid_t) - 1;
+	gid_t   saved_gid = (gid_t) - 1;
+	int     fd;
+
+	caller_creds_set(&saved_uid, &saved_gid);
+
+	if ((fd = open(path, flags | O_NOCTTY | O_NOFOLLOW | O_CLOEXEC,
+		       0644)) < 0)
+		error(EXIT_FAILURE, errno, "open: %s", path);
+
+	caller_creds_restore(saved_uid, saved_gid);
+
+	return fd;
+}
+
+/* Create a listening unix socket only the caller may connect to. */
+
+/* This function may be executed with root privileges. */
+int
+caller_listen(const char *path)
+{
+	uid_t   saved_uid = (uid_t) - 1;
+	gid_t   saved_gid = (gid_t) - 1;
+	struct sockaddr_un sun;
+	int     fd;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(sun.sun_path))
+		error(EXIT_FAILURE, 0, "%s: socket path too long", path);
+	strcpy(sun.sun_path, path);
+
+	caller_creds_set(&saved_uid, &saved_gid);
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			 0)) < 0)
+		error(EXIT_FAILURE, errno, "socket AF_UNIX");
+	if (bind(fd, (struct sockaddr *) &sun, sizeof(sun)) < 0)
+		error(EXIT_FAILURE, errno, "bind: %s", path);
+	/* Do not rely on the umask alone. */
+	if (chmod(path, 0600) < 0)
+		error(EXIT_FAILURE, errno, "chmod: %s", path);
+	if (listen(fd, 16) < 0)
+		error(EXIT_FAILURE, errno, "listen: %s", path);
+
+	caller_creds_restore(saved_uid, saved_gid);
+
+	return fd;
+}
+
 /* This function may be executed with caller or child privileges. */
 void
 nullify_stdin(void)
@@ -162,22 +276,3 @@ write_loop(int fd, const char *buffer, size_t count)
 	}
 	return offset;
 }
-
-/* This function may be executed with caller privileges. */
-void
-fds_add_fd(fd_set *fds, int *max_fd, const int fd)
-{
-	if (fd < 0)
-		return;
-
-	FD_SET(fd, fds);
-	if (fd > *max_fd)
-		*max_fd = fd;
-}
-
-/* This function may be executed with caller privileges. */
-int
-fds_isset(fd_set *fds, const int fd)
-{
-	return (fd >= 0) && FD_ISSET(fd, fds);
-}
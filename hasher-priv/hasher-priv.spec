@@ -44,6 +44,7 @@ fi
 groupadd -r -f hashman
 
 %files
+%_bindir/hasher-transcript
 %_sbindir/hasher-useradd
 %_mandir/man?/*
 # config
@@ -0,0 +1,410 @@
+/*
+  Copyright (C) 2026  agent <agent@local>
+
+  The indexed transcript reader for the hasher-priv project.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Both files are mapped, the chunks of interest are found by a binary
+ * search of the index, and only these chunks of the data file are read.
+ */
+
+#include <errno.h>
+#include <error.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "priv.h"
+#include "transcript.h"
+
+typedef struct
+{
+	const unsigned char *map;
+	size_t  size;
+} map_t;
+
+typedef struct
+{
+	unsigned long long offset, stamp;
+	unsigned chan;
+	size_t  length;
+} entry_t;
+
+static const char *const chan_names[] = {
+	[CHAN_STDOUT] = "stdout",
+	[CHAN_STDERR] = "stderr",
+	[CHAN_SYSLOG] = "syslog"
+};
+
+#define	CHAN_COUNT	(sizeof(chan_names) / sizeof(chan_names[0]))
+
+static void __attribute__ ((noreturn))
+show_usage(const char *str)
+{
+	if (str)
+		fprintf(stderr, "%s: %s\n", program_invocation_short_name, str);
+	fprintf(stderr, "Try `%s --help' for more information.\n",
+		program_invocation_short_name);
+	exit(EXIT_FAILURE);
+}
+
+static void __attribute__ ((noreturn))
+print_help(void)
+{
+	printf("Read an indexed transcript written by hasher-priv.\n"
+	       "\nUsage: %s [options] <transcript>\n"
+	       "\nValid options are:\n"
+	       "  -c, --channel=NAME[,NAME...]\n"
+	       "       output only the given channels: stdout, stderr, syslog;\n"
+	       "  -s, --since=SECONDS\n"
+	       "       start at the given time since the session start;\n"
+	       "  -u, --until=SECONDS\n"
+	       "       stop at the given time since the session start;\n"
+	       "  -l, --list\n"
+	       "       list chunks instead of writing their contents;\n"
+	       "  -r, --replay[=SPEED]\n"
+	       "       write chunks with their original timing,\n"
+	       "       optionally SPEED times faster;\n"
+	       "  --version\n"
+	       "       print program version and exit;\n"
+	       "  -h, --help\n"
+	       "       print this help text and exit.\n",
+	       program_invocation_short_name);
+	exit(EXIT_SUCCESS);
+}
+
+static void __attribute__ ((noreturn))
+print_version(void)
+{
+	printf("hasher-transcript version %s\n"
+	       "\nCopyright (C) 2026  agent <agent@local>\n"
+	       "\nThis is free software; see the source for copying conditions.\n"
+	       "There is NO warranty; not even for MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.\n"
+	       "\nWritten by agent <agent@local>.\n",
+	       PROJECT_VERSION);
+	exit(EXIT_SUCCESS);
+}
+
+static void
+map_file(map_t *m, const char *path)
+{
+	struct stat st;
+	int     fd;
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+		error(EXIT_FAILURE, errno, "open: %s", path);
+	if (fstat(fd, &st) < 0)
+		error(EXIT_FAILURE, errno, "fstat: %s", path);
+
+	m->size = (size_t) st.st_size;
+	m->map = 0;
+	if (m->size)
+	{
+		void   *p = mmap(0, m->size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+		if (p == MAP_FAILED)
+			error(EXIT_FAILURE, errno, "mmap: %s", path);
+		m->map = p;
+	}
+	(void) close(fd);
+}
+
+static unsigned long long
+get_be(const unsigned char *p, unsigned bytes)
+{
+	unsigned long long value = 0;
+
+	while (bytes--)
+		value = value << 8 | *p++;
+	return value;
+}
+
+static map_t data, idx;
+static size_t entry_count;
+static unsigned long long start_mono, start_real;
+
+static void
+get_entry(entry_t *e, size_t i)
+{
+	const unsigned char *p =
+		idx.map + (i + 1) * TRANSCRIPT_INDEX_ENTRY_SIZE;
+
+	e->offset = get_be(p, 8);
+	e->chan = p[8];
+	e->length = (size_t) get_be(p + 12, 4);
+	e->stamp = get_be(p + 16, 8);
+}
+
+static unsigned long long
+entry_stamp(size_t i)
+{
+	entry_t e;
+
+	get_entry(&e, i);
+	return e.stamp;
+}
+
+/* Return the first entry not earlier than STAMP, or entry_count. */
+static size_t
+find_entry(unsigned long long stamp)
+{
+	size_t  lo = 0, hi = entry_count;
+
+	while (lo < hi)
+	{
+		size_t  mid = lo + (hi - lo) / 2;
+
+		if (entry_stamp(mid) < stamp)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static void
+load_index(const char *path)
+{
+	char   *index_path;
+	size_t  n, lo, hi;
+
+	if (asprintf(&index_path, "%s%s", path, TRANSCRIPT_INDEX_SUFFIX) < 0)
+		error(EXIT_FAILURE, errno, "asprintf");
+
+	map_file(&data, path);
+	map_file(&idx, index_path);
+
+	if (idx.size < TRANSCRIPT_INDEX_ENTRY_SIZE
+	    || memcmp(idx.map, TRANSCRIPT_INDEX_MAGIC, 8))
+		error(EXIT_FAILURE, 0, "%s: not a transcript index", index_path);
+	start_mono = get_be(idx.map + 8, 8);
+	start_real = get_be(idx.map + 16, 8);
+
+	/*
+	 * An index of a session which did not end properly may have
+	 * a zeroed tail of space allocated ahead, drop it.
+	 */
+	n = idx.size / TRANSCRIPT_INDEX_ENTRY_SIZE - 1;
+	for (lo = 0, hi = n; lo < hi;)
+	{
+		size_t  mid = lo + (hi - lo) / 2;
+
+		if (entry_stamp(mid))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	entry_count = lo;
+
+	free(index_path);
+}
+
+static unsigned
+parse_channels(const char *str)
+{
+	char   *list = strdup(str), *name, *save = 0;
+	unsigned mask = 0;
+
+	if (!list)
+		error(EXIT_FAILURE, errno, "strdup");
+
+	for (name = strtok_r(list, ",", &save); name;
+	     name = strtok_r(0, ",", &save))
+	{
+		unsigned i;
+
+		for (i = 0; i < CHAN_COUNT; ++i)
+			if (chan_names[i] && !strcmp(chan_names[i], name))
+				break;
+		if (i == CHAN_COUNT)
+			error(EXIT_FAILURE, 0, "%s: unknown channel", name);
+		mask |= 1U << i;
+	}
+
+	free(list);
+	return mask;
+}
+
+static double
+parse_number(const char *str, const char *what)
+{
+	char   *p = 0;
+	double  value;
+
+	errno = 0;
+	value = strtod(str, &p);
+	if (!p || *p || p == str || errno || value < 0)
+		error(EXIT_FAILURE, 0, "%s: invalid %s value", str, what);
+	return value;
+}
+
+static unsigned long long
+seconds_ns(double seconds)
+{
+	return (unsigned long long) (seconds * 1e9);
+}
+
+static void
+write_chunk(const entry_t *e)
+{
+	if (e->offset > data.size || e->length > data.size - e->offset)
+		error(EXIT_FAILURE, 0, "transcript is shorter than its index");
+	if (fwrite(data.map + e->offset, 1UL, e->length, stdout) != e->length)
+		error(EXIT_FAILURE, errno, "write");
+}
+
+static void
+list_chunk(const entry_t *e)
+{
+	unsigned long long rel = e->stamp - start_mono;
+	unsigned long long real = start_real + rel;
+	time_t  sec = (time_t) (real / 1000000000ULL);
+	struct tm tm;
+	char    buf[64];
+
+	if (!localtime_r(&sec, &tm)
+	    || !strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &tm))
+		buf[0] = '\0';
+
+	printf("%llu.%06llu\t%s.%06llu\t%s\t%llu\t%zu\n",
+	       rel / 1000000000ULL, rel % 1000000000ULL / 1000ULL,
+	       buf, real % 1000000000ULL / 1000ULL,
+	       e->chan < CHAN_COUNT && chan_names[e->chan] ?
+	       chan_names[e->chan] : "unknown", e->offset, e->length);
+}
+
+/* Sleep until the chunk is due, SPEED times faster than recorded. */
+static void
+replay_wait(const entry_t *e, unsigned long long first, double speed,
+	    const struct timespec *base)
+{
+	unsigned long long delay =
+		(unsigned long long) ((double) (e->stamp - first) / speed);
+	struct timespec ts = *base;
+
+	ts.tv_sec += (time_t) (delay / 1000000000ULL);
+	ts.tv_nsec += (long) (delay % 1000000000ULL);
+	if (ts.tv_nsec >= 1000000000L)
+	{
+		ts.tv_nsec -= 1000000000L;
+		++ts.tv_sec;
+	}
+
+	if (fflush(stdout))
+		error(EXIT_FAILURE, errno, "write");
+	while ((errno = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+					&ts, 0)) == EINTR)
+		;
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const struct option longopts[] = {
+		{"channel", required_argument, 0, 'c'},
+		{"since", required_argument, 0, 's'},
+		{"until", required_argument, 0, 'u'},
+		{"list", no_argument, 0, 'l'},
+		{"replay", optional_argument, 0, 'r'},
+		{"help", no_argument, 0, 'h'},
+		{"version", no_argument, 0, 'V'},
+		{0, 0, 0, 0}
+	};
+	unsigned chan_mask = ~0U;
+	unsigned long long since = 0, until = ~0ULL, first = 0;
+	int     list = 0, replay = 0, c;
+	double  speed = 1;
+	struct timespec base;
+	size_t  i;
+
+	while ((c = getopt_long(argc, argv, "c:s:u:lr::h", longopts, 0)) != -1)
+	{
+		switch (c)
+		{
+			case 'c':
+				chan_mask = parse_channels(optarg);
+				break;
+			case 's':
+				since = seconds_ns(parse_number(optarg, "since"));
+				break;
+			case 'u':
+				until = seconds_ns(parse_number(optarg, "until"));
+				break;
+			case 'l':
+				list = 1;
+				break;
+			case 'r':
+				replay = 1;
+				if (optarg
+				    && !(speed = parse_number(optarg, "speed")))
+					error(EXIT_FAILURE, 0,
+					      "%s: invalid speed value", optarg);
+				break;
+			case 'h':
+				print_help();
+			case 'V':
+				print_version();
+			default:
+				show_usage(0);
+		}
+	}
+
+	if (optind != argc - 1)
+		show_usage("transcript file name required");
+
+	load_index(argv[optind]);
+
+	if (clock_gettime(CLOCK_MONOTONIC, &base) < 0)
+		error(EXIT_FAILURE, errno, "clock_gettime");
+
+	for (i = find_entry(start_mono + since); i < entry_count; ++i)
+	{
+		entry_t e;
+
+		get_entry(&e, i);
+		if (e.stamp - start_mono > until)
+			break;
+		if (e.chan >= 32 || !(chan_mask & (1U << e.chan)))
+			continue;
+
+		if (list)
+		{
+			list_chunk(&e);
+			continue;
+		}
+
+		if (replay)
+		{
+			if (!first)
+				first = e.stamp;
+			replay_wait(&e, first, speed, &base);
+		}
+		write_chunk(&e);
+	}
+
+	if (fflush(stdout))
+		error(EXIT_FAILURE, errno, "write");
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,395 @@
+/*
+  Copyright (C) 2026  agent <agent@local>
+
+  The chrootuid parent journal I/O handler for the hasher-priv program.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Code in this file may be executed with caller privileges. */
+
+/*
+ * If journal_socket is enabled, the journal native protocol socket is
+ * provided next to /dev/log.  Each datagram is an entry of fields, either
+ * "NAME=value\n", or "NAME\n" followed by the value length as a 64-bit
+ * little-endian number, the value, and "\n".  An entry too large for a
+ * datagram comes as an empty datagram with a memfd holding the entry.
+ *
+ * Datagrams are drained in batches like those of /dev/log.  Each entry is
+ * turned into a syslog message, "<PRI>IDENTIFIER[PID]: MESSAGE", with the
+ * fields listed in journal_fields appended as " NAME=value", and queued
+ * to the log relay, so it is filtered, rate limited and relayed along
+ * with /dev/log messages.
+ */
+
+#include <errno.h>
+#include <error.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "priv.h"
+#include "xmalloc.h"
+
+#define	JOURNAL_BATCH		8
+#define	JOURNAL_ENTRY_SIZE	(64 * 1024)
+
+/* Descriptors passed along with an entry, only one is expected. */
+#define	JOURNAL_FDS_MAX		4
+
+typedef union
+{
+	struct cmsghdr align;
+	char    buf[CMSG_SPACE(sizeof(struct ucred)) +
+		    CMSG_SPACE(JOURNAL_FDS_MAX * sizeof(int))];
+} journal_ctl_t;
+
+static struct mmsghdr *journal_msgs;
+static struct iovec *journal_iovs;
+static char *journal_bufs;
+static journal_ctl_t *journal_ctls;
+
+/* The entry being turned into a message. */
+typedef struct
+{
+	const char *message, *ident, *pid;
+	size_t  message_len, ident_len, pid_len;
+	int     priority, facility;
+} entry_t;
+
+/* The message is assembled here. */
+static char *line;
+static size_t line_len, line_size;
+
+static void
+line_put(const char *data, size_t len)
+{
+	if (line_len + len > line_size)
+	{
+		line_size = line_len + len;
+		if (line_size < RELAY_BUFSIZE_MIN)
+			line_size = RELAY_BUFSIZE_MIN;
+		line = xrealloc(line, line_size, 1UL);
+	}
+	memcpy(line + line_len, data, len);
+	line_len += len;
+}
+
+static int
+field_is(const char *name, size_t name_len, const char *str)
+{
+	return name_len == strlen(str) && !memcmp(name, str, name_len);
+}
+
+/* Return nonzero if the field is listed in journal_fields. */
+static int
+field_wanted(const char *name, size_t name_len)
+{
+	const char *p = journal_fields;
+
+	while (p && *p)
+	{
+		size_t  len = strcspn(p, " \t,");
+
+		if (len == name_len && !memcmp(p, name, len))
+			return 1;
+		p += len;
+		p += strspn(p, " \t,");
+	}
+
+	return 0;
+}
+
+/*
+ * Parse a decimal field value of LEN bytes, which is not NUL-terminated,
+ * return -1 unless it is a number no greater than MAX.
+ */
+static int
+small_number(const char *value, size_t len, int max)
+{
+	int     n = 0;
+	size_t  i;
+
+	if (!len)
+		return -1;
+	for (i = 0; i < len; ++i)
+	{
+		if (value[i] < '0' || value[i] > '9')
+			return -1;
+		n = n * 10 + (value[i] - '0');
+		if (n > max)
+			return -1;
+	}
+	return n;
+}
+
+/* The extra fields are appended in the order the entry has them. */
+static void
+entry_field(entry_t *e, const char *name, size_t name_len,
+	    const char *value, size_t len, int pass)
+{
+	if (pass)
+	{
+		size_t  i;
+
+		if (!field_wanted(name, name_len))
+			return;
+		line_put(" ", 1);
+		line_put(name, name_len);
+		line_put("=", 1);
+		for (i = 0; i < len; ++i)
+			line_put(value[i] == '\n' ? " " : value + i, 1);
+		return;
+	}
+
+	if (field_is(name, name_len, "MESSAGE"))
+	{
+		e->message = value;
+		e->message_len = len;
+	} else if (field_is(name, name_len, "SYSLOG_IDENTIFIER"))
+	{
+		e->ident = value;
+		e->ident_len = len;
+	} else if (field_is(name, name_len, "SYSLOG_PID"))
+	{
+		e->pid = value;
+		e->pid_len = len;
+	} else if (field_is(name, name_len, "PRIORITY"))
+	{
+		int     n = small_number(value, len, LOG_DEBUG);
+
+		if (n >= 0)
+			e->priority = n;
+	} else if (field_is(name, name_len, "SYSLOG_FACILITY"))
+	{
+		int     n = small_number(value, len, LOG_NFACILITIES - 1);
+
+		if (n >= 0)
+			e->facility = n;
+	}
+}
+
+/*
+ * Walk the fields of an entry of N bytes in BUF; the first pass picks
+ * the fields the message is made of, the second one appends the extras.
+ * Return zero if the entry is malformed.
+ */
+static int
+entry_walk(entry_t *e, const char *buf, size_t n, int pass)
+{
+	const char *p = buf, *end = buf + n;
+
+	while (p < end)
+	{
+		const char *nl = memchr(p, '\n', (size_t) (end - p));
+		const char *stop = nl ? nl : end;
+		const char *eq = memchr(p, '=', (size_t) (stop - p));
+
+		if (eq)
+		{
+			entry_field(e, p, (size_t) (eq - p), eq + 1,
+				    (size_t) (stop - eq - 1), pass);
+			p = stop + 1;
+			continue;
+		}
+
+		/* A binary value, its length is little-endian. */
+		const unsigned char *q = (const unsigned char *) stop + 1;
+		uint64_t len = 0;
+		int     i;
+
+		if (!nl || end - (const char *) q < 8)
+			return 0;
+		for (i = 7; i >= 0; --i)
+			len = len << 8 | q[i];
+		q += 8;
+		if (len > (uint64_t) (end - (const char *) q))
+			return 0;
+
+		entry_field(e, p, (size_t) (nl - p), (const char *) q,
+			    (size_t) len, pass);
+		p = (const char *) q + len + 1;
+	}
+
+	return 1;
+}
+
+static void
+journal_entry(pid_t pid, const char *buf, size_t n)
+{
+	entry_t e = {.priority = LOG_INFO,.facility = LOG_USER >> 3 };
+	char    hdr[64];
+	int     len;
+
+	if (!entry_walk(&e, buf, n, 0) || !e.message)
+		return;
+
+	line_len = 0;
+	len = snprintf(hdr, sizeof(hdr), "<%d>",
+		       LOG_MAKEPRI(e.facility << 3, e.priority));
+	line_put(hdr, (size_t) len);
+	if (e.ident)
+	{
+		line_put(e.ident, e.ident_len);
+		if (e.pid)
+		{
+			line_put("[", 1);
+			line_put(e.pid, e.pid_len);
+			line_put("]", 1);
+		} else if (pid)
+		{
+			len = snprintf(hdr, sizeof(hdr), "[%d]", (int) pid);
+			line_put(hdr, (size_t) len);
+		}
+		line_put(": ", 2);
+	}
+	line_put(e.message, e.message_len);
+	if (journal_fields)
+		(void) entry_walk(&e, buf, n, 1);
+
+	log_queue(pid, line, line_len);
+}
+
+/* Read an entry passed as a memfd, the descriptor is closed. */
+static void
+journal_memfd(pid_t pid, int fd)
+{
+	struct stat st;
+	char   *buf;
+	ssize_t n;
+
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size <= 0
+	    || (unsigned long long) st.st_size > relay_bufsize_max)
+	{
+		(void) close(fd);
+		return;
+	}
+
+	buf = xmalloc((size_t) st.st_size);
+	n = TEMP_FAILURE_RETRY(pread(fd, buf, (size_t) st.st_size, 0));
+	(void) close(fd);
+	if (n > 0)
+	{
+		relay_stats.source[CHAN_SYSLOG].bytes +=
+			(unsigned long long) n;
+		journal_entry(pid, buf, (size_t) n);
+	}
+	free(buf);
+}
+
+static void
+journal_message(struct msghdr *m, const char *buf, size_t n)
+{
+	struct cmsghdr *cmsg;
+	pid_t   pid = 0;
+	int     fd = -1;
+
+	for (cmsg = CMSG_FIRSTHDR(m); cmsg; cmsg = CMSG_NXTHDR(m, cmsg))
+	{
+		if (cmsg->cmsg_level != SOL_SOCKET)
+			continue;
+		if (cmsg->cmsg_type == SCM_CREDENTIALS)
+		{
+			struct ucred cred;
+
+			memcpy(&cred, CMSG_DATA(cmsg), sizeof(cred));
+			pid = cred.pid;
+		} else if (cmsg->cmsg_type == SCM_RIGHTS)
+		{
+			size_t  i, count = (cmsg->cmsg_len - CMSG_LEN(0)) /
+				sizeof(int);
+
+			for (i = 0; i < count; ++i)
+			{
+				int     passed;
+
+				memcpy(&passed, CMSG_DATA(cmsg) +
+				       i * sizeof(int), sizeof(int));
+				if (fd < 0 && !n)
+					fd = passed;
+				else
+					(void) close(passed);
+			}
+		}
+	}
+
+	relay_stats.source[CHAN_SYSLOG].bytes += n;
+	if (fd >= 0)
+		journal_memfd(pid, fd);
+	else
+		journal_entry(pid, buf, n);
+}
+
+void
+journal_handle(ev_watch_t w)
+{
+	ssize_t n;
+	int     i;
+
+	if (!(w->ready & EV_READ))
+		return;
+
+	if (!journal_msgs)
+	{
+		journal_msgs = xcalloc(JOURNAL_BATCH, sizeof(*journal_msgs));
+		journal_iovs = xcalloc(JOURNAL_BATCH, sizeof(*journal_iovs));
+		journal_bufs = xcalloc(JOURNAL_BATCH, JOURNAL_ENTRY_SIZE);
+		journal_ctls = xcalloc(JOURNAL_BATCH, sizeof(*journal_ctls));
+		for (i = 0; i < JOURNAL_BATCH; ++i)
+		{
+			journal_iovs[i].iov_base = journal_bufs +
+				(size_t) i * JOURNAL_ENTRY_SIZE;
+			journal_iovs[i].iov_len = JOURNAL_ENTRY_SIZE;
+			journal_msgs[i].msg_hdr.msg_iov = &journal_iovs[i];
+			journal_msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+	}
+
+	for (i = 0; i < JOURNAL_BATCH; ++i)
+	{
+		journal_msgs[i].msg_hdr.msg_control = &journal_ctls[i];
+		journal_msgs[i].msg_hdr.msg_controllen =
+			sizeof(journal_ctls[i]);
+	}
+
+	n = TEMP_FAILURE_RETRY(recvmmsg(w->fd, journal_msgs, JOURNAL_BATCH,
+					MSG_DONTWAIT | MSG_CMSG_CLOEXEC, 0));
+	++relay_stats.source[CHAN_SYSLOG].reads;
+	if (n <= 0)
+	{
+		w->ready &= ~EV_READ;
+		if (n < 0 && errno != EAGAIN)
+		{
+			error(EXIT_SUCCESS, errno, "recvmmsg");
+			fputc('\r', stderr);
+		}
+		return;
+	}
+
+	for (i = 0; i < n; ++i)
+		journal_message(&journal_msgs[i].msg_hdr,
+				journal_iovs[i].iov_base,
+				journal_msgs[i].msg_len);
+
+	/* A short batch means the queue is empty. */
+	if (n < JOURNAL_BATCH)
+		w->ready &= ~EV_READ;
+	else
+		ev_pend(w);
+}
@@ -25,100 +25,647 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <syslog.h>
 #include <unistd.h>
+#include <sys/socket.h>
 
 #include "priv.h"
 #include "xmalloc.h"
 
-static int *fd_list;
-static size_t fd_count;
+/*
+ * Messages are relayed one per line, or one per frame in framed output
+ * mode.  A stream connection may deliver several messages per read, and
+ * a message may span reads, so each connection keeps the incomplete
+ * tail of what it has sent.  Messages on a stream are either octet
+ * counted, "LENGTH SP MESSAGE" as in RFC 6587, or delimited: by NUL
+ * once the connection has sent one, as glibc does, by newline otherwise.
+ * The first message of a connection decides which, so a delimited
+ * message which happens to start with digits is not taken for a count.
+ * A datagram is a message of its own.
+ *
+ * Messages less important than log_priority are dropped, or written to
+ * the transcript only if log_keep_filtered is enabled.
+ *
+ * If log_rate is set, each process sending messages, identified by its
+ * credentials, has a bucket of log_burst messages refilled at log_rate
+ * messages per second.  Messages of a process out of tokens are counted
+ * instead of relayed, and the count is reported before its next relayed
+ * message, when its connection is closed, or when /dev/log is forgotten.
+ *
+ * Messages are collected during a loop iteration and relayed together
+ * by log_flush() at its end, with a single write to the caller.
+ */
+
+/* Longer messages are split on streams and truncated in datagrams. */
+#define	LOG_MSG_SIZE	8192
+
+/* How messages on a stream connection are framed. */
+#define	LOG_FRAMING_UNKNOWN	0
+#define	LOG_FRAMING_OCTET	1
+#define	LOG_FRAMING_DELIM	2
+
+struct log_conn
+{
+	struct ev_watch w;
+	char   *partial;
+	size_t  partial_len;
+	int     framing, nul_framed;
+	pid_t   pid;
+};
+
+typedef struct log_conn *log_conn_t;
+
+static log_conn_t *conn_list;
+static size_t conn_count;
+
+static void source_forget(pid_t pid);
 
 static void
-fd_new(int fd)
+conn_new(int fd)
 {
 	if (fd < 0)
 		return;
 
 	size_t  i;
 
-	for (i = 0; i < fd_count; ++i)
-		if (fd_list[i] < 0)
+	for (i = 0; i < conn_count; ++i)
+		if (!conn_list[i])
 			break;
 
-	if (i == fd_count)
-		fd_list = xrealloc(fd_list, ++fd_count, sizeof(*fd_list));
+	if (i == conn_count)
+		conn_list = xrealloc(conn_list, ++conn_count,
+				     sizeof(*conn_list));
+
+	conn_list[i] = xcalloc(1UL, sizeof(*conn_list[i]));
+	if (log_rate)
+	{
+		struct ucred cred;
+		socklen_t len = sizeof(cred);
 
-	fd_list[i] = fd;
+		if (!getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len))
+			conn_list[i]->pid = cred.pid;
+	}
 	unblock_fd(fd);
+	ev_add(&conn_list[i]->w, fd, EV_READ, log_handle_select,
+	       conn_list[i]);
 }
 
 static void
-fd_free(const int fd)
+conn_free(log_conn_t c)
 {
 	size_t  i;
+	int     fd = c->w.fd;
 
-	for (i = 0; i < fd_count; ++i)
-		if (fd == fd_list[i])
+	for (i = 0; i < conn_count; ++i)
+		if (c == conn_list[i])
 			break;
 
-	if (i == fd_count)
+	if (i == conn_count)
 		error(EXIT_FAILURE, 0,
-		      "fd_free: descriptor %d not found, count=%lu\n",
-		      fd, (unsigned long) fd_count);
+		      "conn_free: descriptor %d not found, count=%lu\n",
+		      fd, (unsigned long) conn_count);
 
-	fd_list[i] = -1;
+	conn_list[i] = 0;
+	source_forget(c->pid);
+	ev_del(&c->w);
 	(void) close(fd);
+	free(c->partial);
+	free(c);
 }
 
 void
-log_handle_new(const int fd, fd_set *fds)
+log_handle_new(ev_watch_t w)
 {
-	if (fds_isset(fds, fd))
-		fd_new(unix_accept(fd));
+	if (!(w->ready & EV_READ))
+		return;
+
+	int     fd = unix_accept(w->fd);
+
+	if (fd < 0)
+	{
+		w->ready &= ~EV_READ;
+		return;
+	}
+
+	conn_new(fd);
+	++relay_stats.log_connections;
+	ev_pend(w);
 }
 
+/*
+ * Messages collected for the caller stderr during this loop iteration,
+ * by the thread running the loop.
+ */
+static __thread char *out_buf;
+static __thread size_t out_len, out_size;
+
+/* Relay the messages collected so far. */
 void
-fds_add_log(fd_set *fds, int *max_fd)
+log_flush(void)
+{
+	if (!out_len)
+		return;
+
+	xwrite_all(STDERR_FILENO, out_buf, out_len);
+	out_len = 0;
+}
+
+static void
+log_relay(const char *msg, size_t n)
+{
+	/* A frame delimits the message itself. */
+	if (framed_output)
+	{
+		xwrite_chan(CHAN_SYSLOG, msg, n);
+		return;
+	}
+
+	if (out_len + n + 2 > relay_bufsize_max)
+		log_flush();
+	if (out_len + n + 2 > out_size)
+	{
+		out_size = out_len + n + 2;
+		if (out_size < RELAY_BUFSIZE_MIN)
+			out_size = RELAY_BUFSIZE_MIN;
+		out_buf = xrealloc(out_buf, out_size, 1UL);
+	}
+	memcpy(out_buf + out_len, msg, n);
+	out_len += n;
+	out_buf[out_len++] = '\r';
+	out_buf[out_len++] = '\n';
+}
+
+/* Write a message filtered out to the transcript only. */
+static void
+log_keep(const char *msg, size_t n)
+{
+	/* Keep the order of messages in the transcript. */
+	log_flush();
+
+	if (framed_output)
+		xwrite_transcript(CHAN_SYSLOG, msg, n);
+	else
+	{
+		xwrite_transcript(CHAN_STDERR, msg, n);
+		xwrite_transcript(CHAN_STDERR, "\r\n", 2);
+	}
+}
+
+/* Return the severity of a message from its <PRI> header. */
+static int
+log_severity(const char *msg, size_t n)
+{
+	unsigned pri = 0;
+	size_t  i;
+
+	if (!n || msg[0] != '<')
+		return LOG_NOTICE;
+
+	for (i = 1; i < n && i <= 4 && msg[i] >= '0' && msg[i] <= '9'; ++i)
+		pri = pri * 10 + (unsigned) (msg[i] - '0');
+
+	if (i == 1 || i >= n || msg[i] != '>' || pri > (LOG_LOCAL7 | LOG_DEBUG))
+		return LOG_NOTICE;
+
+	return LOG_PRI((int) pri);
+}
+
+struct log_source
+{
+	pid_t   pid;
+	double  tokens;
+	unsigned long long stamp;
+	unsigned long suppressed;
+};
+
+static struct log_source *source_list;
+static size_t source_count;
+
+static double
+source_burst(void)
+{
+	return (double) (log_burst ? : log_rate);
+}
+
+static void
+source_refill(struct log_source *s, unsigned long long now)
+{
+	s->tokens += (double) (now - s->stamp) * (double) log_rate / 1e9;
+	s->stamp = now;
+	if (s->tokens > source_burst())
+		s->tokens = source_burst();
+}
+
+static struct log_source *
+source_find(pid_t pid)
 {
 	size_t  i;
 
-	for (i = 0; i < fd_count; ++i)
-		fds_add_fd(fds, max_fd, fd_list[i]);
+	for (i = 0; i < source_count; ++i)
+		if (source_list[i].pid == pid)
+			return &source_list[i];
+
+	return 0;
+}
+
+static struct log_source *
+source_get(pid_t pid, unsigned long long now)
+{
+	struct log_source *s = source_find(pid);
+	size_t  i;
+
+	if (s)
+		return s;
+
+	/* Reuse a source which is back to a full bucket anyway. */
+	for (i = 0; i < source_count && !s; ++i)
+	{
+		source_refill(&source_list[i], now);
+		if (!source_list[i].suppressed
+		    && source_list[i].tokens >= source_burst())
+			s = &source_list[i];
+	}
+
+	if (!s)
+	{
+		source_list = xrealloc(source_list, ++source_count,
+				       sizeof(*source_list));
+		s = &source_list[source_count - 1];
+	}
+
+	s->pid = pid;
+	s->tokens = source_burst();
+	s->stamp = now;
+	s->suppressed = 0;
+	return s;
+}
+
+static void
+source_report(struct log_source *s)
+{
+	char    buf[128];
+	int     n;
+
+	if (!s->suppressed)
+		return;
+
+	n = snprintf(buf, sizeof(buf),
+		     "hasher-priv: %lu messages from process %d suppressed",
+		     s->suppressed, (int) s->pid);
+	s->suppressed = 0;
+
+	if (framed_output)
+		relay_event(CHAN_SYSLOG, "%s", buf);
+	else if (n > 0)
+		log_relay(buf, (size_t) n);
+}
+
+/* Report messages suppressed from PID, if any. */
+static void
+source_forget(pid_t pid)
+{
+	struct log_source *s = log_rate ? source_find(pid) : 0;
+
+	if (s)
+		source_report(s);
+}
+
+/* Return nonzero if a message from PID is within the rate limit. */
+static int
+source_allow(pid_t pid)
+{
+	unsigned long long now;
+	struct log_source *s;
+
+	if (!log_rate)
+		return 1;
+
+	now = stats_now();
+	s = source_get(pid, now);
+	source_refill(s, now);
+	if (s->tokens < 1)
+	{
+		++s->suppressed;
+		++relay_stats.log_suppressed;
+		return 0;
+	}
+	s->tokens -= 1;
+	source_report(s);
+	return 1;
 }
 
+/*
+ * Queue a message of N bytes in MSG sent by PID, the message ends at the
+ * first NUL.
+ */
+void
+log_queue(pid_t pid, const char *msg, size_t n)
+{
+	const char *nul = memchr(msg, '\0', n);
+
+	if (nul)
+		n = (size_t) (nul - msg);
+	while (n > 0 && (msg[n - 1] == '\n' || msg[n - 1] == '\r'))
+		--n;
+	if (!n)
+		return;
+
+	if (log_severity(msg, n) > log_priority)
+	{
+		++relay_stats.log_filtered;
+		if (log_keep_filtered)
+			log_keep(msg, n);
+		return;
+	}
+
+	if (source_allow(pid))
+		log_relay(msg, n);
+}
+
+/*
+ * Parse an octet counted frame header at P of N bytes.  Return the
+ * header length and store the message length in LEN; return 0 if there
+ * is no such header, or -1 if the header is not complete yet.
+ */
+static int
+octet_count(const char *p, size_t n, size_t *len)
+{
+	size_t  i, value = 0;
+
+	if (!n || p[0] < '1' || p[0] > '9')
+		return 0;
+
+	for (i = 0; i < n && p[i] >= '0' && p[i] <= '9'; ++i)
+	{
+		value = value * 10 + (size_t) (p[i] - '0');
+		if (value > LOG_MSG_SIZE)
+			return 0;
+	}
+
+	if (i == n)
+		return -1;
+	if (p[i] != ' ')
+		return 0;
+
+	*len = value;
+	return (int) i + 1;
+}
+
+/*
+ * Queue complete messages of N bytes in BUF sent by connection C, return
+ * the number of bytes consumed.  At the end of stream, whatever is left
+ * is a message as well.
+ */
+static size_t
+log_parse(log_conn_t c, const char *buf, size_t n, int eof)
+{
+	size_t  off = 0;
+
+	while (off < n)
+	{
+		const char *p = buf + off, *end;
+		size_t  left = n - off, len;
+		int     hdr = c->framing == LOG_FRAMING_DELIM ? 0 :
+			octet_count(p, left, &len);
+
+		if (c->framing == LOG_FRAMING_UNKNOWN)
+		{
+			if (hdr < 0 && !eof)
+				break;
+			c->framing = hdr > 0 ? LOG_FRAMING_OCTET :
+				LOG_FRAMING_DELIM;
+		}
+
+		if (hdr > 0)
+		{
+			if (left - (size_t) hdr < len)
+			{
+				if (!eof)
+					break;
+				len = left - (size_t) hdr;
+			}
+			log_queue(c->pid, p + hdr, len);
+			off += (size_t) hdr + len;
+			continue;
+		}
+		if (hdr < 0 && !eof)
+			break;
+
+		end = memchr(p, c->nul_framed ? '\0' : '\n', left);
+		if (!end)
+		{
+			if (!eof && left < LOG_MSG_SIZE)
+				break;
+			len = left < LOG_MSG_SIZE ? left : LOG_MSG_SIZE;
+			log_queue(c->pid, p, len);
+			off += len;
+			continue;
+		}
+
+		len = (size_t) (end - p);
+		log_queue(c->pid, p, len);
+		off += len + 1;
+	}
+
+	return off;
+}
+
+/* Read buffer shared by all log connections, it adapts to the messages. */
+static ring_t log_ring;
+
 static void
-copy_log(const int fd)
+copy_log(log_conn_t c)
 {
+	ev_watch_t w = &c->w;
 	ssize_t i;
-	char    buf[BUFSIZ];
+	size_t  n, used;
 
-	i = read_retry(fd, buf, sizeof(buf) - 2);
+	if (!log_ring.buf)
+		ring_init(&log_ring, RELAY_BUFSIZE_MIN, relay_bufsize_max);
+
+	n = ring_space(&log_ring);
+	i = ring_read(&log_ring, w->fd);
+	ev_read_done(w, i, n);
+	++relay_stats.source[CHAN_SYSLOG].reads;
+	if (i < 0 && errno == EAGAIN)
+		return;
 	if (i <= 0)
 	{
-		fd_free(fd);
+		(void) log_parse(c, c->partial, c->partial_len, 1);
+		conn_free(c);
+		return;
+	}
+	relay_stats.source[CHAN_SYSLOG].bytes += (unsigned long long) i;
+
+	/* The ring was empty, so the data read is contiguous. */
+	char   *buf = ring_data(&log_ring, &n);
+
+	if (!c->nul_framed && memchr(buf, '\0', n))
+		c->nul_framed = 1;
+
+	if (c->partial_len)
+	{
+		c->partial = xrealloc(c->partial, c->partial_len + n, 1UL);
+		memcpy(c->partial + c->partial_len, buf, n);
+		c->partial_len += n;
+		buf = c->partial;
+		n = c->partial_len;
+	}
+
+	used = log_parse(c, buf, n, 0);
+
+	/* Keep the incomplete message for the next read. */
+	if (buf == c->partial)
+		memmove(c->partial, c->partial + used, n - used);
+	else if (n > used)
+	{
+		c->partial = xrealloc(c->partial, n - used, 1UL);
+		memcpy(c->partial, buf + used, n - used);
+	}
+	c->partial_len = n - used;
+	ring_drop(&log_ring, ring_used(&log_ring));
+
+	if (w->ready & EV_READ)
+		ev_pend(w);
+}
+
+void
+log_handle_select(ev_watch_t w)
+{
+	if (w->ready & EV_READ)
+		copy_log(w->data);
+}
+
+/*
+ * A datagram /dev/log gets one message per datagram and no connections,
+ * it is drained in batches of up to LOG_BATCH messages per recvmmsg(2).
+ * The sender credentials come along if log_rate is set.
+ */
+#define	LOG_BATCH	32
+
+typedef union
+{
+	struct cmsghdr align;
+	char    buf[CMSG_SPACE(sizeof(struct ucred))];
+} log_ctl_t;
+
+static struct mmsghdr *log_msgs;
+static struct iovec *log_iovs;
+static char *log_bufs;
+static log_ctl_t *log_ctls;
+
+static pid_t
+dgram_pid(struct msghdr *m)
+{
+	struct cmsghdr *cmsg;
+
+	for (cmsg = CMSG_FIRSTHDR(m); cmsg; cmsg = CMSG_NXTHDR(m, cmsg))
+		if (cmsg->cmsg_level == SOL_SOCKET
+		    && cmsg->cmsg_type == SCM_CREDENTIALS)
+		{
+			struct ucred cred;
+
+			memcpy(&cred, CMSG_DATA(cmsg), sizeof(cred));
+			return cred.pid;
+		}
+
+	return 0;
+}
+
+static void
+log_handle_dgram(ev_watch_t w)
+{
+	ssize_t n;
+	int     i;
+
+	if (!(w->ready & EV_READ))
 		return;
+
+	if (!log_msgs)
+	{
+		log_msgs = xcalloc(LOG_BATCH, sizeof(*log_msgs));
+		log_iovs = xcalloc(LOG_BATCH, sizeof(*log_iovs));
+		log_bufs = xcalloc(LOG_BATCH, LOG_MSG_SIZE);
+		log_ctls = xcalloc(LOG_BATCH, sizeof(*log_ctls));
+		for (i = 0; i < LOG_BATCH; ++i)
+		{
+			log_iovs[i].iov_base =
+				log_bufs + (size_t) i * LOG_MSG_SIZE;
+			log_iovs[i].iov_len = LOG_MSG_SIZE;
+			log_msgs[i].msg_hdr.msg_iov = &log_iovs[i];
+			log_msgs[i].msg_hdr.msg_iovlen = 1;
+		}
 	}
 
-	buf[i] = '\0';
+	for (i = 0; log_rate && i < LOG_BATCH; ++i)
+	{
+		log_msgs[i].msg_hdr.msg_control = &log_ctls[i];
+		log_msgs[i].msg_hdr.msg_controllen = sizeof(log_ctls[i]);
+	}
 
-	size_t  n = strlen(buf);
+	n = TEMP_FAILURE_RETRY(recvmmsg(w->fd, log_msgs, LOG_BATCH,
+					MSG_DONTWAIT, 0));
+	++relay_stats.source[CHAN_SYSLOG].reads;
+	if (n <= 0)
+	{
+		w->ready &= ~EV_READ;
+		if (n < 0 && errno != EAGAIN)
+		{
+			error(EXIT_SUCCESS, errno, "recvmmsg");
+			fputc('\r', stderr);
+		}
+		return;
+	}
 
-	if (n > 0 && buf[n - 1] != '\n')
+	for (i = 0; i < n; ++i)
 	{
-		buf[n++] = '\r';
-		buf[n++] = '\n';
+		size_t  len = log_msgs[i].msg_len;
+
+		relay_stats.source[CHAN_SYSLOG].bytes += len;
+		log_queue(dgram_pid(&log_msgs[i].msg_hdr),
+			  log_iovs[i].iov_base, len);
 	}
 
-	xwrite_all(STDERR_FILENO, buf, n);
+	/* A short batch means the queue is empty. */
+	if (n < LOG_BATCH)
+		w->ready &= ~EV_READ;
+	else
+		ev_pend(w);
 }
 
+/* Return the handler of the /dev/log socket FD. */
+ev_handler_t
+log_handler(int fd)
+{
+	int     type = SOCK_STREAM;
+	socklen_t len = sizeof(type);
+
+	if (fd >= 0 && getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) < 0)
+		error(EXIT_FAILURE, errno, "getsockopt SO_TYPE");
 
+	return type == SOCK_DGRAM ? log_handle_dgram : log_handle_new;
+}
+
+/*
+ * Stop listening to /dev/log or the journal socket.  Messages already
+ * queued on a datagram socket are relayed first, like data of accepted
+ * connections is, and so are counts of messages suppressed so far.
+ */
 void
-log_handle_select(fd_set *fds)
+log_forget(ev_watch_t w)
 {
 	size_t  i;
 
-	for (i = 0; i < fd_count; ++i)
-		if (fds_isset(fds, fd_list[i]))
-			copy_log(fd_list[i]);
+	if (w->fd >= 0
+	    && (w->handler == log_handle_dgram || w->handler == journal_handle))
+	{
+		w->ready |= EV_READ;
+		while (w->ready & EV_READ)
+			w->handler(w);
+	}
+	ev_del(w);
+
+	for (i = 0; log_rate && i < source_count; ++i)
+		source_report(&source_list[i]);
+	log_flush();
 }
@@ -0,0 +1,339 @@
+/*
+  Copyright (C) 2026  agent <agent@local>
+
+  The chrootuid parent X11 and log relay thread for the hasher-priv program.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Code in this file may be executed with caller privileges. */
+
+/*
+ * If relay_thread is enabled, X11 connections, /dev/log and the journal
+ * socket are handled by a thread with an event loop of its own, so that
+ * their traffic does not delay the child stdio relay and vice versa;
+ * the main thread keeps stdio and control.
+ *
+ * Everything written to the caller is owned by the main thread, so the
+ * output of the thread is passed to it as records through a pipe.
+ * The main thread passes commands to the thread through another pipe.
+ * Once told to forget listeners, the thread ends as soon as all its
+ * connections are closed, and the main thread sees the end of records.
+ */
+
+#include <errno.h>
+#include <error.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "priv.h"
+#include "xmalloc.h"
+
+#define	IO_THREAD_CHUNK	(64 * 1024)
+
+struct record
+{
+	unsigned chan;
+	int     event;
+	size_t  len;
+};
+
+#define	RECORD_BUF_SIZE	(2 * (sizeof(struct record) + IO_THREAD_CHUNK))
+
+enum
+{
+	CMD_X11,
+	CMD_FORGET,
+	CMD_QUIT
+};
+
+struct command
+{
+	int     cmd, fd;
+};
+
+static pthread_t io_thread;
+static int io_thread_running, io_thread_forgotten;
+static __thread int in_io_thread;
+
+static int cmd_fds[2] = { -1, -1 }, rec_fds[2] = { -1, -1 };
+
+/* The main thread side. */
+static struct ev_watch rec_w;
+static char *rec_buf;
+static size_t rec_len;
+
+/* The relay thread side. */
+static struct ev_watch cmd_w, x11_listen_w, log_listen_w, journal_w;
+static int log_fd = -1, journal_fd = -1;
+static int thread_quit, thread_forget;
+
+static void
+io_thread_command(ev_watch_t w)
+{
+	struct command c;
+	ssize_t n;
+
+	if (!(w->ready & EV_READ))
+		return;
+
+	n = read_retry(w->fd, &c, sizeof(c));
+	if (n < 0 && errno == EAGAIN)
+	{
+		w->ready &= ~EV_READ;
+		return;
+	}
+	if (n != (ssize_t) sizeof(c))
+	{
+		thread_quit = 1;
+		return;
+	}
+	ev_pend(w);
+
+	switch (c.cmd)
+	{
+		case CMD_X11:
+			ev_add(&x11_listen_w, c.fd, EV_READ, x11_handle_new,
+			       0);
+			break;
+		case CMD_FORGET:
+			log_forget(&log_listen_w);
+			log_forget(&journal_w);
+			ev_del(&x11_listen_w);
+			thread_forget = 1;
+			break;
+		default:
+			thread_quit = 1;
+			break;
+	}
+}
+
+static void *
+io_thread_loop(void __attribute__ ((unused)) * arg)
+{
+	in_io_thread = 1;
+
+	ev_init();
+	ev_add(&cmd_w, cmd_fds[0], EV_READ | EV_AUX, io_thread_command, 0);
+	ev_add(&x11_listen_w, -1, EV_READ, x11_handle_new, 0);
+	ev_add(&log_listen_w, log_fd, EV_READ, log_handler(log_fd), 0);
+	ev_add(&journal_w, journal_fd, EV_READ, journal_handle, 0);
+
+	while (!thread_quit && (!thread_forget || ev_input_count()))
+	{
+		if (ev_poll(-1) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			error(EXIT_FAILURE, errno, "relay thread");
+		}
+		ev_dispatch();
+		log_flush();
+	}
+
+	ev_fini();
+
+	/* The main thread sees the end of records. */
+	(void) close(rec_fds[1]);
+	rec_fds[1] = -1;
+	return 0;
+}
+
+/*
+ * Pass output of the relay thread to the main thread; EVENT is nonzero
+ * for events, negative for output to the transcript only.
+ * Return zero if not called by the relay thread.
+ */
+int
+io_thread_output(unsigned chan, int event, const char *buffer, size_t count)
+{
+	if (!in_io_thread)
+		return 0;
+
+	do
+	{
+		struct record r = { chan, event, count };
+
+		if (r.len > IO_THREAD_CHUNK)
+			r.len = IO_THREAD_CHUNK;
+
+		/* Failure means the main thread is no longer listening. */
+		if (thread_quit
+		    || write_loop(rec_fds[1], (const char *) &r,
+				  sizeof(r)) != (ssize_t) sizeof(r)
+		    || write_loop(rec_fds[1], buffer,
+				  r.len) != (ssize_t) r.len)
+		{
+			thread_quit = 1;
+			break;
+		}
+		buffer += r.len;
+		count -= r.len;
+	}
+	while (count);
+
+	return 1;
+}
+
+static void
+io_thread_records(ev_watch_t w)
+{
+	size_t  space = RECORD_BUF_SIZE - rec_len, off = 0;
+	ssize_t n;
+
+	if (!(w->ready & EV_READ))
+		return;
+
+	n = read_retry(w->fd, rec_buf + rec_len, space);
+	ev_read_done(w, n, space);
+	if (n < 0 && errno == EAGAIN)
+		return;
+	if (n <= 0)
+	{
+		/* The relay thread is over. */
+		ev_del(w);
+		return;
+	}
+	rec_len += (size_t) n;
+
+	while (rec_len - off >= sizeof(struct record))
+	{
+		struct record r;
+		const char *data = rec_buf + off + sizeof(r);
+
+		memcpy(&r, rec_buf + off, sizeof(r));
+		if (rec_len - off - sizeof(r) < r.len)
+			break;
+
+		if (r.event < 0)
+			xwrite_transcript(r.chan, data, r.len);
+		else if (r.event)
+			relay_event(r.chan, "%.*s", (int) r.len, data);
+		else
+			xwrite_chan(r.chan, data, r.len);
+		off += sizeof(r) + r.len;
+	}
+	rec_len -= off;
+	memmove(rec_buf, rec_buf + off, rec_len);
+
+	if (w->ready & EV_READ)
+		ev_pend(w);
+}
+
+static void
+io_thread_send(int cmd, int fd)
+{
+	struct command c = { cmd, fd };
+
+	if (write_loop(cmd_fds[1], (const char *) &c, sizeof(c)) !=
+	    (ssize_t) sizeof(c))
+		error(EXIT_FAILURE, errno, "relay thread command");
+}
+
+/*
+ * Start the relay thread listening to LOG_FD and JOURNAL_FD if
+ * relay_thread is enabled, return nonzero if started.
+ */
+int
+io_thread_start(int a_log_fd, int a_journal_fd)
+{
+	sigset_t set, saved;
+	int     rc;
+
+	if (!relay_thread)
+		return 0;
+
+	if (pipe2(cmd_fds, O_CLOEXEC) || pipe2(rec_fds, O_CLOEXEC))
+		error(EXIT_FAILURE, errno, "pipe");
+	unblock_fd(cmd_fds[0]);
+	unblock_fd(rec_fds[0]);
+	(void) fcntl(rec_fds[1], F_SETPIPE_SZ, (int) relay_bufsize_max);
+
+	rec_buf = xmalloc(RECORD_BUF_SIZE);
+	rec_len = 0;
+
+	/* The relay loop keeps running until the relay thread is over. */
+	ev_add(&rec_w, rec_fds[0], EV_READ, io_thread_records, 0);
+
+	/* Signals are for the relay loop only. */
+	sigfillset(&set);
+	pthread_sigmask(SIG_SETMASK, &set, &saved);
+	log_fd = a_log_fd;
+	journal_fd = a_journal_fd;
+	rc = pthread_create(&io_thread, 0, io_thread_loop, 0);
+	pthread_sigmask(SIG_SETMASK, &saved, 0);
+	if (rc)
+		error(EXIT_FAILURE, rc, "pthread_create");
+
+	io_thread_running = 1;
+	if (atexit(io_thread_stop))
+		error(EXIT_FAILURE, errno, "atexit");
+
+	return 1;
+}
+
+/* Pass X11 listening socket to the relay thread, return nonzero if passed. */
+int
+io_thread_x11(int fd)
+{
+	if (!io_thread_running)
+		return 0;
+
+	io_thread_send(CMD_X11, fd);
+	return 1;
+}
+
+/*
+ * Let the relay thread forget its listeners and end once its connections
+ * are closed, return nonzero if the relay thread is running.
+ */
+int
+io_thread_forget(void)
+{
+	if (!io_thread_running)
+		return 0;
+
+	if (!io_thread_forgotten)
+		io_thread_send(CMD_FORGET, -1);
+	io_thread_forgotten = 1;
+	return 1;
+}
+
+/* Stop the relay thread, its output not yet relayed is discarded. */
+void
+io_thread_stop(void)
+{
+	if (!io_thread_running || in_io_thread)
+		return;
+	io_thread_running = 0;
+
+	/* The thread may be blocked writing records nobody is to read. */
+	ev_del(&rec_w);
+	(void) close(rec_fds[0]);
+	rec_fds[0] = -1;
+
+	io_thread_send(CMD_QUIT, -1);
+	pthread_join(io_thread, 0);
+
+	(void) close(cmd_fds[0]);
+	(void) close(cmd_fds[1]);
+	cmd_fds[0] = cmd_fds[1] = -1;
+	free(rec_buf);
+	rec_buf = 0;
+}
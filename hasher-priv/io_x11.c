@@ -20,22 +20,39 @@
 
 /* Code in this file may be executed with caller privileges. */
 
+/*
+ * The first packet of the client carries the auth data to be rewritten,
+ * so connections start relaying through rings.  Once it is handled and
+ * a ring is drained, that direction switches to splice(2) through a pipe
+ * of its own, and the rest of the traffic is not copied to user space.
+ * A connection which cannot get pipes keeps using the rings.
+ */
+
 #include <errno.h>
 #include <error.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <sys/ioctl.h>
 
 #include "priv.h"
 #include "xmalloc.h"
 
+struct x11_pipe
+{
+	int     fds[2];
+	size_t  queued, size;
+	int     full;
+};
+
 struct io_x11
 {
-	int     master_fd, slave_fd;
-	size_t  master_avail, slave_avail;
-	int     authenticated;
-	char    master_buf[BUFSIZ], slave_buf[BUFSIZ];
+	struct ev_watch master_w, slave_w;
+	ring_t  master_ring, slave_ring;
+	struct x11_pipe master_pipe, slave_pipe;
+	int     authenticated, no_splice;
 };
 
 typedef struct io_x11 *io_x11_t;
@@ -43,6 +60,15 @@ typedef struct io_x11 *io_x11_t;
 static io_x11_t *io_x11_list;
 static size_t io_x11_count;
 
+static const char *x11_saved_data, *x11_fake_data;
+
+void
+x11_set_auth_data(const char *saved_data, const char *fake_data)
+{
+	x11_saved_data = saved_data;
+	x11_fake_data = fake_data;
+}
+
 static  io_x11_t
 io_x11_new(int master_fd, int slave_fd)
 {
@@ -59,14 +85,30 @@ io_x11_new(int master_fd, int slave_fd)
 
 	io_x11_t io = io_x11_list[i] = xcalloc(1UL, sizeof(*io_x11_list[i]));
 
-	io->master_fd = master_fd;
-	io->slave_fd = slave_fd;
+	ring_init(&io->master_ring, RELAY_BUFSIZE_MIN, relay_bufsize_max);
+	ring_init(&io->slave_ring, RELAY_BUFSIZE_MIN, relay_bufsize_max);
+	io->master_pipe.fds[0] = io->master_pipe.fds[1] = -1;
+	io->slave_pipe.fds[0] = io->slave_pipe.fds[1] = -1;
 	unblock_fd(master_fd);
 	unblock_fd(slave_fd);
+	ev_add(&io->master_w, master_fd, EV_READ | EV_WRITE,
+	       x11_handle_select, io);
+	ev_add(&io->slave_w, slave_fd, EV_READ | EV_WRITE,
+	       x11_handle_select, io);
 
 	return io;
 }
 
+static void
+x11_pipe_close(struct x11_pipe *p)
+{
+	if (p->fds[0] < 0)
+		return;
+	(void) close(p->fds[0]);
+	(void) close(p->fds[1]);
+	p->fds[0] = p->fds[1] = -1;
+}
+
 static void
 io_x11_free(io_x11_t io)
 {
@@ -81,64 +123,60 @@ io_x11_free(io_x11_t io)
 		      (unsigned long) io_x11_count);
 	io_x11_list[i] = 0;
 
-	(void) close(io->master_fd);
-	(void) close(io->slave_fd);
+	int     master_fd = io->master_w.fd, slave_fd = io->slave_w.fd;
+
+	ev_del(&io->master_w);
+	ev_del(&io->slave_w);
+	(void) close(master_fd);
+	(void) close(slave_fd);
+	ring_free(&io->master_ring);
+	ring_free(&io->slave_ring);
+	x11_pipe_close(&io->master_pipe);
+	x11_pipe_close(&io->slave_pipe);
 	memset(io, 0, sizeof(*io));
 	free(io);
+
+	relay_event(CHAN_X11, "X11 connection closed");
 }
 
 void
-x11_handle_new(const int x11_fd, fd_set *read_fds)
+x11_handle_new(ev_watch_t w)
 {
-	if (!fds_isset(read_fds, x11_fd))
+	if (!(w->ready & EV_READ))
 		return;
 
-	int     accept_fd = unix_accept(x11_fd);
+	int     accept_fd = unix_accept(w->fd);
 
 	if (accept_fd < 0)
+	{
+		w->ready &= ~EV_READ;
 		return;
+	}
+	ev_pend(w);
 
 	int     connect_fd = x11_connect();
 
 	if (connect_fd >= 0)
+	{
 		io_x11_new(connect_fd, accept_fd);
-	else
-		(void) close(accept_fd);
-}
-
-void
-fds_add_x11(fd_set *read_fds, fd_set *write_fds, int *max_fd)
-{
-	size_t i;
-
-	for (i = 0; i < io_x11_count; ++i)
+		++relay_stats.x11_connections;
+		relay_event(CHAN_X11, "X11 connection opened");
+	} else
 	{
-		io_x11_t io;
-
-		if (!(io = io_x11_list[i]))
-			continue;
-
-		if (io->slave_avail)
-			fds_add_fd(write_fds, max_fd, io->master_fd);
-		else
-			fds_add_fd(read_fds, max_fd, io->slave_fd);
-
-		if (io->master_avail)
-			fds_add_fd(write_fds, max_fd, io->slave_fd);
-		else
-			fds_add_fd(read_fds, max_fd, io->master_fd);
+		(void) close(accept_fd);
+		relay_event(CHAN_X11, "X11 connection refused");
 	}
 }
 
 static void
-io_check_auth_data(io_x11_t io, const char *x11_saved_data,
-		   const char *x11_fake_data)
+io_check_auth_data(io_x11_t io)
 {
 	if (io->authenticated)
 		return;
 	io->authenticated = 1;
 
-	size_t avail = io->slave_avail, expected = 12;
+	size_t avail, expected = 12;
+	unsigned char *p = (unsigned char *) ring_data(&io->slave_ring, &avail);
 
 	if (avail < expected)
 	{
@@ -148,7 +186,6 @@ io_check_auth_data(io_x11_t io, const char *x11_saved_data,
 		return;
 	}
 	unsigned proto_len = 0, data_len = 0;
-	unsigned char *p = (unsigned char *) io->slave_buf;
 
 	if (p[0] == 0x42)
 	{			/* Byte order MSB first. */
@@ -190,83 +227,182 @@ io_check_auth_data(io_x11_t io, const char *x11_saved_data,
 	       x11_saved_data, x11_data_len);
 }
 
-void
-x11_handle_select(fd_set *read_fds, fd_set *write_fds,
-		  const char *x11_saved_data, const char *x11_fake_data)
+/*
+ * Relay data in one direction: fill the ring from SRC while there is
+ * space, then drain it to DST.  Return -1 if the connection has to be
+ * closed.
+ */
+static int
+io_x11_relay(io_x11_t io, ev_watch_t src, ev_watch_t dst, ring_t *r)
 {
-	size_t i;
+	size_t  len;
 	ssize_t n;
 
-	for (i = 0; i < io_x11_count; ++i)
+	if ((len = ring_space(r)) && (src->ready & EV_READ))
 	{
-		io_x11_t io;
+		n = ring_read(r, src->fd);
+		ev_read_done(src, n, len);
+		++relay_stats.source[CHAN_X11].reads;
+		if (n > 0)
+			relay_stats.source[CHAN_X11].bytes +=
+				(unsigned long long) n;
+		if (n < 0 && errno == EAGAIN)
+			n = 0;
+		else if (n <= 0)
+			return -1;
+
+		if (n && src == &io->slave_w)
+			io_check_auth_data(io);
+	}
 
-		if (!(io = io_x11_list[i]))
-			continue;
+	if ((len = ring_used(r)) && (dst->ready & EV_WRITE))
+	{
+		n = ring_write(r, dst->fd);
+		ev_write_done(dst, n, len);
+		if (n < 0 && errno == EAGAIN)
+			n = 0;
+		else if (n <= 0)
+			return -1;
+	}
 
-		if (io->master_avail && fds_isset(write_fds, io->slave_fd))
-		{
-			n = write_loop(io->slave_fd,
-				       io->master_buf, io->master_avail);
-			if (n <= 0)
-			{
-				io_x11_free(io);
-				continue;
-			}
-
-			if ((size_t) n < io->master_avail)
-			{
-				memmove(io->master_buf,
-					io->master_buf + (size_t) n,
-					io->master_avail - (size_t) n);
-			}
-			io->master_avail -= (size_t) n;
-		}
+	/* Come back if there is more to relay. */
+	if ((ring_space(r) && (src->ready & EV_READ))
+	    || (ring_used(r) && (dst->ready & EV_WRITE)))
+		ev_pend(src);
+
+	return 0;
+}
+
+/* Return nonzero if the direction is switched to splice. */
+static int
+x11_pipe_open(io_x11_t io, struct x11_pipe *p, ring_t *r)
+{
+	int     size;
+
+	if (p->fds[0] >= 0)
+		return 1;
+	if (io->no_splice || !io->authenticated || ring_used(r))
+		return 0;
+
+	if (pipe2(p->fds, O_CLOEXEC | O_NONBLOCK) < 0)
+	{
+		p->fds[0] = p->fds[1] = -1;
+		io->no_splice = 1;
+		return 0;
+	}
 
-		if (!io->master_avail && fds_isset(read_fds, io->master_fd))
+	(void) fcntl(p->fds[1], F_SETPIPE_SZ, (int) relay_bufsize_max);
+	if ((size = fcntl(p->fds[1], F_GETPIPE_SZ)) <= 0)
+		size = RELAY_BUFSIZE_MIN;
+	p->size = (size_t) size;
+	p->queued = 0;
+	p->full = 0;
+
+	/* The ring is no longer needed. */
+	ring_free(r);
+	return 1;
+}
+
+/*
+ * Return nonzero if SRC has nothing more to read.  A pipe fills up by
+ * buffer slots rather than by bytes, so a short splice into a pipe that
+ * holds data does not tell whether it is the source or the pipe that
+ * ran out.
+ */
+static int
+x11_source_drained(ev_watch_t src, struct x11_pipe *p)
+{
+	int     avail;
+
+	if (!p->queued)
+		return 1;
+	if (ioctl(src->fd, FIONREAD, &avail) < 0)
+		return 0;
+	return avail <= 0;
+}
+
+/*
+ * Relay data in one direction through the pipe: splice from SRC until
+ * the pipe fills up, then splice to DST.  Return -1 if the connection
+ * has to be closed.
+ */
+static int
+io_x11_splice(ev_watch_t src, ev_watch_t dst, struct x11_pipe *p)
+{
+	stats_source_t *stats = &relay_stats.source[CHAN_X11];
+	ssize_t n;
+
+	if (!p->full && (src->ready & EV_READ))
+	{
+		n = splice(src->fd, 0, p->fds[1], 0, p->size,
+			   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		++stats->splices;
+		if (n == 0 || (n < 0 && errno != EAGAIN))
+			return -1;
+		if (n > 0)
 		{
-			n = read_retry(io->master_fd,
-				       io->master_buf, sizeof io->master_buf);
-			if (n <= 0)
-			{
-				io_x11_free(io);
-				continue;
-			}
-
-			io->master_avail = (size_t) n;
+			stats->bytes += (unsigned long long) n;
+			p->queued += (size_t) n;
 		}
-
-		if (io->slave_avail && fds_isset(write_fds, io->master_fd))
+		if (n < 0 || (size_t) n < p->size)
 		{
-			n = write_loop(io->master_fd,
-				       io->slave_buf, io->slave_avail);
-			if (n <= 0)
-			{
-				io_x11_free(io);
-				continue;
-			}
-
-			if ((size_t) n < io->slave_avail)
-			{
-				memmove(io->slave_buf,
-					io->slave_buf + (size_t) n,
-					io->slave_avail - (size_t) n);
-			}
-			io->slave_avail -= (size_t) n;
+			/* Keep the source readable until the pipe drains. */
+			if (x11_source_drained(src, p))
+				ev_read_done(src, n, p->size);
+			else
+				p->full = 1;
 		}
+	}
 
-		if (!io->slave_avail && fds_isset(read_fds, io->slave_fd))
+	if (p->queued && (dst->ready & EV_WRITE))
+	{
+		n = splice(p->fds[0], 0, dst->fd, 0, p->queued,
+			   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		ev_write_done(dst, n, p->queued);
+		if (n < 0 && errno == EAGAIN)
+			n = 0;
+		else if (n <= 0)
+			return -1;
+		if (n > 0)
 		{
-			n = read_retry(io->slave_fd,
-				       io->slave_buf, sizeof io->slave_buf);
-			if (n <= 0)
-			{
-				io_x11_free(io);
-				continue;
-			}
-
-			io->slave_avail = (size_t) n;
-			io_check_auth_data(io, x11_saved_data, x11_fake_data);
+			p->queued -= (size_t) n;
+			p->full = 0;
 		}
 	}
+
+	/* Come back if there is more to relay. */
+	if ((!p->full && (src->ready & EV_READ))
+	    || (p->queued && (dst->ready & EV_WRITE)))
+		ev_pend(src);
+
+	return 0;
+}
+
+static int
+io_x11_forward(io_x11_t io, ev_watch_t src, ev_watch_t dst, ring_t *r,
+	       struct x11_pipe *p)
+{
+	if (x11_pipe_open(io, p, r))
+		return io_x11_splice(src, dst, p);
+
+	if (io_x11_relay(io, src, dst, r) < 0)
+		return -1;
+
+	/* The auth packet may have just been drained. */
+	if (x11_pipe_open(io, p, r))
+		ev_pend(src);
+
+	return 0;
+}
+
+void
+x11_handle_select(ev_watch_t w)
+{
+	io_x11_t io = w->data;
+
+	if (io_x11_forward(io, &io->master_w, &io->slave_w,
+			   &io->master_ring, &io->master_pipe) < 0
+	    || io_x11_forward(io, &io->slave_w, &io->master_w,
+			      &io->slave_ring, &io->slave_pipe) < 0)
+		io_x11_free(io);
 }
@@ -26,7 +26,9 @@
 #include <stdlib.h>
 #include <signal.h>
 #include <unistd.h>
+#include <grp.h>
 #include <sys/prctl.h>
+#include <sys/wait.h>
 
 #include "priv.h"
 
@@ -64,3 +66,72 @@ do_killuid(void)
 
 	return 0;
 }
+
+/*
+ * Start a process which kills all processes of the given user
+ * the same way as killuid does, once a byte is written to the pipe
+ * returned, and exits when the pipe is closed.  The process is forked
+ * twice, so it is not a child of the caller, and it drops privileges
+ * right away, so the unprivileged chrootuid parent can terminate
+ * the child process tree using it.  Unlike killuid, only the given
+ * user is covered: the child process tree cannot change its uid, and
+ * processes of the other user belong to sessions of their own.
+ */
+int
+killuid_helper(uid_t uid, gid_t gid)
+{
+	int     fds[2], status;
+	pid_t   pid;
+
+	if (pipe(fds))
+		error(EXIT_FAILURE, errno, "pipe");
+
+	if ((pid = fork()) < 0)
+		error(EXIT_FAILURE, errno, "fork");
+
+	if (!pid)
+	{
+		char    c;
+
+		if (close(fds[1]) || chdir("/"))
+			error(EXIT_FAILURE, errno, "killuid helper");
+
+		if (setgroups(0UL, 0) < 0)
+			error(EXIT_FAILURE, errno, "setgroups");
+
+		if (setgid(gid) < 0)
+			error(EXIT_FAILURE, errno, "setgid");
+
+		if (prctl(PR_SET_DUMPABLE, 0) && !__libc_enable_secure)
+			error(EXIT_FAILURE, errno,
+			      "killuid helper: prctl PR_SET_DUMPABLE");
+
+		if (setuid(uid) < 0)
+			error(EXIT_FAILURE, errno, "setuid");
+
+		/* Process is no longer privileged at this point. */
+
+		if ((pid = fork()) < 0)
+			error(EXIT_FAILURE, errno, "fork");
+		if (pid)
+			_exit(EXIT_SUCCESS);
+
+		/* Nothing of the caller is kept but the pipe. */
+		close_fds_except(fds[0]);
+
+		if (read_retry(fds[0], &c, 1UL) == 1 && kill(-1, SIGKILL))
+			error(EXIT_FAILURE, errno, "killuid helper: kill");
+
+		_exit(EXIT_SUCCESS);
+	}
+
+	if (TEMP_FAILURE_RETRY(waitpid(pid, &status, 0)) != pid)
+		error(EXIT_FAILURE, errno, "waitpid");
+	if (!WIFEXITED(status) || WEXITSTATUS(status))
+		error(EXIT_FAILURE, 0, "killuid helper failed");
+
+	if (close(fds[0]))
+		error(EXIT_FAILURE, errno, "close");
+
+	return fds[1];
+}
@@ -0,0 +1,272 @@
+/*
+  Copyright (C) 2026  agent <agent@local>
+
+  The chrootuid parent session observers for the hasher-priv program.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Observers connected to the observe_socket get a copy of everything
+ * relayed to the caller.  The output is kept in a single buffer of the
+ * last OBSERVE_BUF_SIZE bytes, addressed by the offset from the session
+ * start; each observer only has its own offset in it.  An observer
+ * starts with what the buffer still holds, is written to only when its
+ * socket accepts data, and is dropped once it falls behind the buffer,
+ * so observers never slow down the relay.
+ */
+
+#include <errno.h>
+#include <error.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "priv.h"
+#include "xmalloc.h"
+
+#define	OBSERVE_BUF_SIZE	(1024 * 1024)
+
+struct observer
+{
+	struct ev_watch w;
+	unsigned long long offset;
+};
+
+typedef struct observer *observer_t;
+
+static observer_t *observer_list;
+static size_t observer_count;
+
+static int listen_fd = -1, dir_fd = -1;
+static struct ev_watch listen_w;
+
+static char *obuf;
+static unsigned long long obuf_total;
+
+/* Create the socket while the caller file system is visible. */
+
+/* This function may be executed with root privileges. */
+void
+observe_open(void)
+{
+	char   *dir;
+
+	if (!observe_socket)
+		return;
+
+	/* The socket is removed at exit relative to its directory. */
+	dir = xstrdup(observe_socket);
+	if (strrchr(dir, '/') == dir)
+		dir[1] = '\0';
+	else
+		*strrchr(dir, '/') = '\0';
+	dir_fd = caller_open(dir, O_PATH | O_DIRECTORY);
+	free(dir);
+
+	listen_fd = caller_listen(observe_socket);
+}
+
+/* The code below may be executed with caller privileges. */
+
+static void
+observer_free(observer_t o)
+{
+	size_t  i;
+	int     fd = o->w.fd;
+
+	for (i = 0; i < observer_count; ++i)
+		if (observer_list[i] == o)
+			observer_list[i] = 0;
+
+	ev_del(&o->w);
+	(void) close(fd);
+	free(o);
+}
+
+static void
+observer_flush(observer_t o)
+{
+	while ((o->w.ready & EV_WRITE) && o->offset < obuf_total)
+	{
+		size_t  off = (size_t) (o->offset & (OBSERVE_BUF_SIZE - 1));
+		size_t  len = OBSERVE_BUF_SIZE - off;
+		ssize_t n;
+
+		if (len > obuf_total - o->offset)
+			len = (size_t) (obuf_total - o->offset);
+
+		n = TEMP_FAILURE_RETRY(write(o->w.fd, obuf + off, len));
+		ev_write_done(&o->w, n, len);
+		if (n < 0)
+		{
+			/* Observer has gone. */
+			if (errno != EAGAIN)
+				observer_free(o);
+			return;
+		}
+		o->offset += (unsigned long long) n;
+	}
+}
+
+static void
+observer_handle(ev_watch_t w)
+{
+	observer_flush(w->data);
+}
+
+static void
+observe_accept(ev_watch_t w)
+{
+	observer_t o;
+	size_t  i;
+	int     fd;
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if (!(w->ready & EV_READ))
+		return;
+
+	if ((fd = unix_accept(w->fd)) < 0)
+	{
+		w->ready &= ~EV_READ;
+		return;
+	}
+	ev_pend(w);
+
+	/* Only the caller and root may observe the session. */
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0
+	    || (cred.uid != caller_uid && cred.uid != 0))
+	{
+		(void) close(fd);
+		return;
+	}
+
+	for (i = 0; i < observer_count; ++i)
+		if (!observer_list[i])
+			break;
+	if (i == observer_count)
+		observer_list = xrealloc(observer_list, ++observer_count,
+					 sizeof(*observer_list));
+
+	o = observer_list[i] = xcalloc(1UL, sizeof(*o));
+	o->offset = obuf_total > OBSERVE_BUF_SIZE ?
+		obuf_total - OBSERVE_BUF_SIZE : 0;
+
+	unblock_fd(fd);
+	(void) fcntl(fd, F_SETFD, FD_CLOEXEC);
+	ev_add(&o->w, fd, EV_WRITE, observer_handle, o);
+	o->w.ready |= EV_WRITE;
+	observer_flush(o);
+}
+
+/* Start accepting observers, return nonzero if the socket is enabled. */
+int
+observe_start(void)
+{
+	if (listen_fd < 0)
+		return 0;
+
+	obuf = xmalloc(OBSERVE_BUF_SIZE);
+	ev_add(&listen_w, listen_fd, EV_READ | EV_AUX, observe_accept, 0);
+
+	if (atexit(observe_finish))
+		error(EXIT_FAILURE, errno, "atexit");
+
+	return 1;
+}
+
+void
+observe_write(const char *buffer, size_t count)
+{
+	size_t  i;
+
+	if (!obuf)
+		return;
+
+	/* Only the last OBSERVE_BUF_SIZE bytes can be kept. */
+	if (count > OBSERVE_BUF_SIZE)
+	{
+		obuf_total += count - OBSERVE_BUF_SIZE;
+		buffer += count - OBSERVE_BUF_SIZE;
+		count = OBSERVE_BUF_SIZE;
+	}
+
+	while (count)
+	{
+		size_t  off = (size_t) (obuf_total & (OBSERVE_BUF_SIZE - 1));
+		size_t  len = OBSERVE_BUF_SIZE - off;
+
+		if (len > count)
+			len = count;
+		memcpy(obuf + off, buffer, len);
+		obuf_total += len;
+		buffer += len;
+		count -= len;
+	}
+
+	for (i = 0; i < observer_count; ++i)
+	{
+		observer_t o = observer_list[i];
+
+		if (!o)
+			continue;
+		if (obuf_total - o->offset > OBSERVE_BUF_SIZE)
+			observer_free(o);
+		else
+			observer_flush(o);
+	}
+}
+
+/* Give observers what they accept now, disconnect them, remove the socket. */
+void
+observe_finish(void)
+{
+	size_t  i;
+
+	if (!obuf)
+		return;
+
+	for (i = 0; i < observer_count; ++i)
+	{
+		observer_t o = observer_list[i];
+
+		if (!o)
+			continue;
+		observer_flush(o);
+		if (observer_list[i])
+			observer_free(o);
+	}
+	free(observer_list);
+	observer_list = 0;
+	observer_count = 0;
+
+	ev_del(&listen_w);
+	(void) close(listen_fd);
+	listen_fd = -1;
+
+	if (unlinkat(dir_fd, strrchr(observe_socket, '/') + 1, 0) < 0)
+	{
+		error(EXIT_SUCCESS, errno, "unlink: %s", observe_socket);
+		fputc('\r', stderr);
+	}
+	(void) close(dir_fd);
+	dir_fd = -1;
+
+	free(obuf);
+	obuf = 0;
+}
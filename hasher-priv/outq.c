@@ -0,0 +1,449 @@
+/*
+  Copyright (C) 2026  agent <agent@local>
+
+  The chrootuid parent caller output queues for the hasher-priv program.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Code in this file may be executed with caller privileges. */
+
+/*
+ * The file status flags of caller stdout and stderr are shared with
+ * other processes and are left alone.  Instead, every write is made not
+ * to block: sockets are written with MSG_DONTWAIT, pipes and ttys are
+ * polled for writability before each write of at most PIPE_BUF bytes,
+ * other files are written as usual.  Whatever the caller is not ready
+ * to accept is queued in a memory ring of output_queue_size bytes, and
+ * what does not fit there is spilled to an unlinked temporary file, so
+ * a stalled caller never stalls the relay loop.  Once something is spilled,
+ * newer data is appended to the spill file until it is drained,
+ * to keep the order.
+ */
+
+#include <errno.h>
+#include <error.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "priv.h"
+#include "xmalloc.h"
+
+#define	OUTQ_SPILL_DIR	"/tmp"
+
+typedef enum
+{
+	OUTQ_OFF = 0,		/* not relaying, plain blocking writes */
+	OUTQ_FILE,		/* regular files and the like */
+	OUTQ_PIPE,
+	OUTQ_TTY,
+	OUTQ_SOCKET
+} outq_mode_t;
+
+struct outq
+{
+	struct ev_watch w;
+	int     fd;
+	outq_mode_t mode;
+	ring_t  mem;
+	int     spill_fd;
+	off_t   spill_rd, spill_wr;
+	unsigned long long backlog_start;
+};
+
+static struct outq outq_list[2] = {
+	{.fd = STDOUT_FILENO,.spill_fd = -1},
+	{.fd = STDERR_FILENO,.spill_fd = -1}
+};
+
+/* Caller stdout and stderr refer to the same file, keep one queue. */
+static int outq_shared;
+
+static struct outq *
+outq_get(int fd)
+{
+	size_t  i;
+
+	if (outq_shared && fd == STDERR_FILENO)
+		fd = STDOUT_FILENO;
+
+	for (i = 0; i < sizeof(outq_list) / sizeof(outq_list[0]); ++i)
+		if (outq_list[i].fd == fd)
+			return &outq_list[i];
+
+	error(EXIT_FAILURE, 0, "outq_get: descriptor %d not found", fd);
+	return 0;
+}
+
+static int
+outq_empty(struct outq *q)
+{
+	return !ring_used(&q->mem) && q->spill_rd == q->spill_wr;
+}
+
+static stats_sink_t *
+outq_stats(struct outq *q)
+{
+	return &relay_stats.sink[q->fd - 1];
+}
+
+static void
+outq_count_write(struct outq *q, ssize_t n)
+{
+	stats_sink_t *s = outq_stats(q);
+
+	++s->writes;
+	if (n > 0)
+		s->bytes += (unsigned long long) n;
+}
+
+/* Note the queue depth; the time spent non-empty is the backlog. */
+static void
+outq_count_queued(struct outq *q)
+{
+	stats_sink_t *s = outq_stats(q);
+	unsigned long long queued = ring_used(&q->mem) +
+		(unsigned long long) (q->spill_wr - q->spill_rd);
+
+	if (queued > s->queue_max)
+		s->queue_max = queued;
+	if (queued && !q->backlog_start)
+		q->backlog_start = stats_now();
+}
+
+static void
+outq_count_drained(struct outq *q)
+{
+	if (q->backlog_start)
+		outq_stats(q)->backlog_ns += stats_now() - q->backlog_start;
+	q->backlog_start = 0;
+}
+
+/* Wait until the caller accepts more output. */
+static void
+outq_wait(struct outq *q)
+{
+	struct pollfd pfd = {.fd = q->fd,.events = POLLOUT };
+	unsigned long long start = stats_now();
+
+	if (TEMP_FAILURE_RETRY(poll(&pfd, 1, -1)) < 0)
+		error(EXIT_FAILURE, errno, "poll");
+	outq_stats(q)->blocked_ns += stats_now() - start;
+}
+
+static int
+outq_writable(struct outq *q)
+{
+	struct pollfd pfd = {.fd = q->fd,.events = POLLOUT };
+
+	return TEMP_FAILURE_RETRY(poll(&pfd, 1, 0)) > 0;
+}
+
+/*
+ * Write to the caller without blocking, return what write(2) on
+ * a non-blocking descriptor would.
+ */
+static ssize_t
+outq_send(struct outq *q, const char *buffer, size_t count)
+{
+	size_t  offset = 0;
+
+	switch (q->mode)
+	{
+		case OUTQ_SOCKET:
+			return TEMP_FAILURE_RETRY(send(q->fd, buffer, count,
+						       MSG_DONTWAIT));
+		case OUTQ_PIPE:
+		case OUTQ_TTY:
+			break;
+		default:
+			return write_loop(q->fd, buffer, count);
+	}
+
+	/* Once polled writable, PIPE_BUF bytes fit without blocking. */
+	while (offset < count && outq_writable(q))
+	{
+		size_t  len = count - offset;
+		ssize_t n;
+
+		if (len > PIPE_BUF)
+			len = PIPE_BUF;
+		n = write_retry(q->fd, buffer + offset, len);
+		if (n <= 0)
+			return offset ? (ssize_t) offset : n;
+		offset += (size_t) n;
+	}
+
+	if (!offset && count)
+	{
+		errno = EAGAIN;
+		return -1;
+	}
+	return (ssize_t) offset;
+}
+
+/* Open an unlinked temporary file. */
+int
+spill_open(void)
+{
+	int     fd = open(OUTQ_SPILL_DIR, O_TMPFILE | O_RDWR | O_EXCL, 0600);
+
+	/* O_TMPFILE is not supported by the kernel or the file system. */
+	if (fd < 0 && (errno == EOPNOTSUPP || errno == EISDIR ||
+		       errno == EINVAL || errno == ENOENT))
+	{
+		char    name[] = OUTQ_SPILL_DIR "/hasher-priv.XXXXXX";
+
+		if ((fd = mkstemp(name)) >= 0)
+			(void) unlink(name);
+	}
+	if (fd < 0)
+	{
+		error(EXIT_SUCCESS, errno, "open: %s", OUTQ_SPILL_DIR);
+		fputc('\r', stderr);
+	}
+
+	return fd;
+}
+
+static void
+outq_drain(struct outq *q)
+{
+	size_t  len;
+	ssize_t n;
+
+	while (q->w.ready & EV_WRITE)
+	{
+		if (!ring_used(&q->mem))
+		{
+			if (q->spill_rd == q->spill_wr)
+				break;
+
+			/* Refill the ring from the spill file. */
+			n = ring_pread(&q->mem, q->spill_fd, q->spill_rd);
+			if (n <= 0)
+				error(EXIT_FAILURE, n ? errno : 0, "pread");
+			q->spill_rd += n;
+			if (q->spill_rd == q->spill_wr)
+			{
+				if (ftruncate(q->spill_fd, 0) < 0)
+					error(EXIT_FAILURE, errno, "ftruncate");
+				q->spill_rd = q->spill_wr = 0;
+			}
+		}
+
+		const char *data = ring_data(&q->mem, &len);
+
+		n = outq_send(q, data, len);
+		if (n > 0)
+			ring_drop(&q->mem, (size_t) n);
+		outq_count_write(q, n);
+		ev_write_done(&q->w, n, len);
+		if (n < 0 && errno != EAGAIN)
+			error(EXIT_FAILURE, errno, "write");
+	}
+
+	if (outq_empty(q))
+		outq_count_drained(q);
+}
+
+static void
+outq_handle(ev_watch_t w)
+{
+	outq_drain(w->data);
+}
+
+/* Write out as much as the caller accepts now, queue the rest. */
+void
+outq_write(int fd, const char *buffer, size_t count)
+{
+	struct outq *q = outq_get(fd);
+	ssize_t n;
+
+	if (q->mode == OUTQ_OFF)
+	{
+		/* Not relaying, plain blocking write. */
+		n = write_loop(fd, buffer, count);
+		outq_count_write(q, n);
+		if (n != (ssize_t) count)
+			error(EXIT_FAILURE, errno, "write");
+		return;
+	}
+
+	if (outq_empty(q) && (q->w.ready & EV_WRITE))
+	{
+		n = outq_send(q, buffer, count);
+		outq_count_write(q, n);
+		ev_write_done(&q->w, n, count);
+		if (n < 0 && errno != EAGAIN)
+			error(EXIT_FAILURE, errno, "write");
+		if (n > 0)
+		{
+			buffer += n;
+			count -= (size_t) n;
+		}
+	}
+
+	if (!count)
+		return;
+
+	if (!q->mem.buf)
+		ring_init(&q->mem, output_queue_size, output_queue_size);
+
+	if (q->spill_rd == q->spill_wr)
+	{
+		size_t  len = ring_space(&q->mem);
+
+		if (len > count)
+			len = count;
+		ring_put(&q->mem, buffer, len);
+		buffer += len;
+		count -= len;
+	}
+
+	while (count)
+	{
+		if (q->spill_fd < 0 && (q->spill_fd = spill_open()) < 0)
+		{
+			/* Nowhere to spill, wait for the caller. */
+			outq_wait(q);
+			q->w.ready |= EV_WRITE;
+			outq_drain(q);
+
+			size_t  len = ring_space(&q->mem);
+
+			if (len > count)
+				len = count;
+			ring_put(&q->mem, buffer, len);
+			buffer += len;
+			count -= len;
+			continue;
+		}
+
+		n = TEMP_FAILURE_RETRY(pwrite(q->spill_fd, buffer, count,
+					      q->spill_wr));
+		if (n <= 0)
+			error(EXIT_FAILURE, n ? errno : 0, "pwrite");
+		q->spill_wr += n;
+		buffer += n;
+		count -= (size_t) n;
+	}
+
+	outq_count_queued(q);
+}
+
+/* Return nonzero if nothing is queued and the caller accepts data. */
+int
+outq_idle(int fd)
+{
+	struct outq *q = outq_get(fd);
+
+	return q->mode == OUTQ_OFF || (outq_empty(q) && (q->w.ready & EV_WRITE));
+}
+
+/*
+ * Return nonzero if splice(2) with SPLICE_F_NONBLOCK cannot block on
+ * the caller descriptor; that flag only covers the pipe ends.
+ */
+int
+outq_splice_ok(int fd)
+{
+	outq_mode_t mode = outq_get(fd)->mode;
+
+	return mode == OUTQ_PIPE || mode == OUTQ_FILE;
+}
+
+/* Note that the caller descriptor would block. */
+void
+outq_busy(int fd)
+{
+	outq_get(fd)->w.ready &= ~EV_WRITE;
+}
+
+void
+outq_init(void)
+{
+	size_t  i, n = sizeof(outq_list) / sizeof(outq_list[0]);
+
+	struct stat st[2];
+
+	for (i = 0; i < n; ++i)
+	{
+		struct outq *q = &outq_list[i];
+
+		if (fstat(q->fd, &st[i]) < 0)
+			error(EXIT_FAILURE, errno, "fstat");
+
+		if (S_ISSOCK(st[i].st_mode))
+			q->mode = OUTQ_SOCKET;
+		else if (S_ISFIFO(st[i].st_mode))
+			q->mode = OUTQ_PIPE;
+		else if (isatty(q->fd))
+			q->mode = OUTQ_TTY;
+		else
+			q->mode = OUTQ_FILE;
+	}
+
+	if (st[0].st_dev == st[1].st_dev && st[0].st_ino == st[1].st_ino)
+		outq_shared = 1;
+
+	for (i = 0; i < n; ++i)
+	{
+		struct outq *q = &outq_list[i];
+
+		if (outq_get(q->fd) != q)
+			continue;
+
+		ev_add(&q->w, q->fd, EV_WRITE, outq_handle, q);
+		q->w.ready |= EV_WRITE;
+	}
+}
+
+/* Write out everything queued, waiting for the caller if necessary. */
+void
+outq_flush(void)
+{
+	size_t  i;
+
+	for (i = 0; i < sizeof(outq_list) / sizeof(outq_list[0]); ++i)
+	{
+		struct outq *q = &outq_list[i];
+
+		if (q->mode == OUTQ_OFF || outq_get(q->fd) != q)
+			continue;
+
+		while (!outq_empty(q))
+		{
+			q->w.ready |= EV_WRITE;
+			outq_drain(q);
+			if (!outq_empty(q))
+				outq_wait(q);
+		}
+
+		ev_del(&q->w);
+		ring_free(&q->mem);
+		if (q->spill_fd >= 0)
+			(void) close(q->spill_fd);
+		q->spill_fd = -1;
+		q->spill_rd = q->spill_wr = 0;
+		q->mode = OUTQ_OFF;
+	}
+}
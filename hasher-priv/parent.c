@@ -27,85 +27,80 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <time.h>
 #include <signal.h>
-#include <setjmp.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
 #include <sys/wait.h>
 
 #include "priv.h"
 #include "xmalloc.h"
 
-static volatile pid_t child_pid;
+static pid_t child_pid;
+static int pty_fd = -1;
 
-static volatile sig_atomic_t sigwinch_arrived;
-static volatile sig_atomic_t canjump;
+/*
+ * Child termination and window size changes are reported by signalfd
+ * descriptors handled in the event loop, both signals stay blocked
+ * all the time.  The parent is the child subreaper, so SIGCHLD also
+ * reports termination of every orphaned descendant of the child.
+ */
+static struct ev_watch child_w, winch_w, grace_w;
 
-static sigjmp_buf jmpbuf;
+/* The pipe to the killuid helper, see killuid_helper(). */
+static int kill_fd = -1;
 
 static int
-xselect(int nfds, fd_set *read_fds, fd_set *write_fds,
-	const unsigned long int timeout)
+signal_fd(int no)
 {
-	struct timeval tmout;
-	sigset_t savemask, sigmask;
-
-	tmout.tv_sec = (time_t) timeout;
-	tmout.tv_usec = 0;
-	sigemptyset(&sigmask);
-
-	if (sigprocmask (SIG_SETMASK, NULL, &savemask) < 0)
-		error(EXIT_FAILURE, errno, "sigprocmask");
-
-	if (sigsetjmp(jmpbuf, 1))
-	{
-		if (sigprocmask (SIG_SETMASK, &savemask, NULL) < 0)
-			error(EXIT_FAILURE, errno, "sigprocmask");
-		errno = EINTR;
-		return -1;
-	}
-	canjump = 1;
+	sigset_t set;
+	int     fd;
 
-	if (sigprocmask (SIG_SETMASK, &sigmask, NULL) < 0)
-		error(EXIT_FAILURE, errno, "sigprocmask");
+	sigemptyset(&set);
+	sigaddset(&set, no);
+	if ((fd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC)) < 0)
+		error(EXIT_FAILURE, errno, "signalfd");
+	return fd;
+}
 
-	int rc = select(nfds, read_fds, write_fds, NULL,
-		       (timeout ? &tmout : 0));
-	int save_errno = errno;
+/* Consume queued signals, return nonzero if there were any. */
+static int
+drain_signal_fd(int fd)
+{
+	struct signalfd_siginfo si[8];
+	ssize_t n;
+	int     got = 0;
 
-	canjump = 0;
-	if (sigprocmask (SIG_SETMASK, &savemask, NULL) < 0)
-		error(EXIT_FAILURE, errno, "sigprocmask");
-	errno = save_errno;
-	return rc;
+	while ((n = read_retry(fd, si, sizeof(si))) > 0)
+		got = 1;
+	if (n < 0 && errno != EAGAIN)
+		error(EXIT_FAILURE, errno, "read signalfd");
+	return got;
 }
 
 static void
-sigwinch_handler(int __attribute__((unused)) signo)
+close_watch(ev_watch_t w)
 {
-	++sigwinch_arrived;
-	if (canjump)
-	{
-		canjump = 0;
-		siglongjmp(jmpbuf, 1);
-	}
+	int     fd = w->fd;
+
+	if (fd < 0)
+		return;
+	ev_del(w);
+	(void) close(fd);
 }
 
 static int child_rc;
 
+/* Nonzero until the whole child process tree is reaped. */
+static int tree_alive = 1;
+
 static void
-sigchld_handler(int __attribute__ ((unused)) signo)
+set_child_rc(int status)
 {
-	int     status;
-	pid_t   child = child_pid;
-
-	/* handle only one child */
-	if (!child)
-		return;
-	child_pid = 0;
-
-	if (waitpid(child, &status, 0) != child)
-		error(EXIT_FAILURE, errno, "waitpid");
-
 	if (WIFEXITED(status))
 	{
 		if (WEXITSTATUS(status))
@@ -120,42 +115,81 @@ sigchld_handler(int __attribute__ ((unused)) signo)
 		/* quite strange condition */
 		child_rc = 255;
 	}
+}
 
-	if (canjump)
+static void
+reap_children(void)
+{
+	int     status;
+	pid_t   pid;
+
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+		if (pid == child_pid)
+		{
+			child_pid = 0;
+			set_child_rc(status);
+		}
+
+	if (pid < 0)
 	{
-		canjump = 0;
-		siglongjmp(jmpbuf, 1);
+		if (errno != ECHILD)
+			error(EXIT_FAILURE, errno, "waitpid");
+		tree_alive = 0;
 	}
 }
 
 static void
-forget_child(void)
+handle_winch(ev_watch_t w)
 {
-	if (child_pid)
-	{
-		child_rc = 128 + SIGTERM;
+	if (!(w->ready & EV_READ))
+		return;
+	w->ready &= ~EV_READ;
 
-		/* no need to kill, we have no perms,
-		   and it will receive HUP anyway. */
-		child_pid = 0;
-	}
+	if (drain_signal_fd(w->fd))
+		(void) tty_copy_winsize(STDIN_FILENO, pty_fd);
 }
 
+/* Ask the killuid helper to kill the child process tree. */
 static void
-wait_child(void)
+kill_tree(void)
 {
-	unsigned i;
+	if (kill_fd < 0 || !tree_alive)
+		return;
 
-	block_signal_handler(SIGCHLD, SIG_UNBLOCK);
-	for (i = 0; i < 10; ++i)
-		if (child_pid)
-			usleep(100000);
+	if (write_loop(kill_fd, "", 1UL) != 1)
+	{
+		error(EXIT_SUCCESS, errno, "killuid helper");
+		fputc('\r', stderr);
+	}
+	(void) close(kill_fd);
+	kill_fd = -1;
+}
+
+static void
+forget_child(void)
+{
+	if (child_pid)
+	{
+		child_rc = 128 + SIGTERM;
+		child_pid = 0;
+	}
+	close_watch(&child_w);
+	close_watch(&grace_w);
+	if (kill_fd >= 0)
+		(void) close(kill_fd);
+	kill_fd = -1;
 }
 
 static void __attribute__ ((noreturn, format(printf, 1, 0)))
 limit_exceeded(const char *fmt, unsigned long limit)
 {
+	kill_tree();
 	forget_child();
+	io_thread_stop();
+	quiet_flush(1);
+	relay_event(CHAN_LIMIT, fmt, limit);
+	outq_flush();
+	transcript_finish();
 	restore_tty();
 	fputc('\n', stderr);
 	error(128 + SIGTERM, 0, fmt, limit);
@@ -175,39 +209,420 @@ work_limits_ok(unsigned long bytes_read, unsigned long bytes_written)
 		limit_exceeded("bytes written limit (%lu bytes) exceeded",
 			       wlimit.bytes_written);
 
-	if (wlimit.time_elapsed)
+	return 1;
+}
+
+/*
+ * Time limits are CLOCK_MONOTONIC timers handled in the event loop.
+ * The elapsed time timer fires once.  The idle time timer ticks
+ * IDLE_TICKS times per limit period and the limit is exceeded after
+ * IDLE_TICKS ticks in a row without child output or caller input, so
+ * the relay itself needs no clock calls to track activity.
+ */
+#define	IDLE_TICKS	8
+
+static struct ev_watch elapsed_w, idle_w;
+static unsigned long idle_bytes_written;
+static unsigned idle_ticks;
+static int idle_input;		/* caller input read since the last tick */
+static unsigned long total_bytes_read, total_bytes_written;
+
+static void
+timer_arm(int fd, unsigned long long ns, int periodic)
+{
+	struct itimerspec its;
+
+	if (!ns)
+		ns = 1;
+	its.it_value.tv_sec = (time_t) (ns / 1000000000);
+	its.it_value.tv_nsec = (long) (ns % 1000000000);
+	if (periodic)
+		its.it_interval = its.it_value;
+	else
+		its.it_interval.tv_sec = its.it_interval.tv_nsec = 0;
+
+	if (timerfd_settime(fd, 0, &its, 0) < 0)
+		error(EXIT_FAILURE, errno, "timerfd_settime");
+}
+
+static int
+timer_fd(unsigned long long ns, int periodic)
+{
+	int     fd;
+
+	if ((fd = timerfd_create(CLOCK_MONOTONIC,
+				 TFD_NONBLOCK | TFD_CLOEXEC)) < 0)
+		error(EXIT_FAILURE, errno, "timerfd_create");
+
+	if (ns)
+		timer_arm(fd, ns, periodic);
+
+	return fd;
+}
+
+/* Return the number of expirations since the last call. */
+static uint64_t
+timer_expirations(ev_watch_t w)
+{
+	uint64_t n = 0;
+
+	w->ready &= ~EV_READ;
+	if (read_retry(w->fd, &n, sizeof(n)) != (ssize_t) sizeof(n))
 	{
-		static time_t t_start;
+		if (errno != EAGAIN)
+			error(EXIT_FAILURE, errno, "read timerfd");
+		n = 0;
+	}
+	return n;
+}
 
-		if (!t_start)
-			time(&t_start);
-		else
-		{
-			time_t  t_now;
+static void
+handle_elapsed(ev_watch_t w)
+{
+	unsigned long ms = wlimit.time_elapsed;
+
+	if (!(w->ready & EV_READ) || !timer_expirations(w))
+		return;
+
+	if (ms % 1000)
+		limit_exceeded("time elapsed limit (%lu milliseconds) exceeded",
+			       ms);
+	limit_exceeded("time elapsed limit (%lu seconds) exceeded",
+		       ms / 1000);
+}
+
+static void
+handle_idle(ev_watch_t w)
+{
+	unsigned long ms = wlimit.time_idle;
+	uint64_t n;
+
+	if (!(w->ready & EV_READ) || !(n = timer_expirations(w)))
+		return;
+
+	if (idle_bytes_written != total_bytes_written || idle_input)
+	{
+		idle_bytes_written = total_bytes_written;
+		idle_input = 0;
+		idle_ticks = 0;
+		return;
+	}
+
+	idle_ticks += (unsigned) (n < IDLE_TICKS ? n : IDLE_TICKS);
+	if (idle_ticks < IDLE_TICKS)
+		return;
+
+	if (ms % 1000)
+		limit_exceeded("idle time limit (%lu milliseconds) exceeded",
+			       ms);
+	limit_exceeded("idle time limit (%lu seconds) exceeded", ms / 1000);
+}
 
-			time(&t_now);
-			if (t_start + (time_t) wlimit.time_elapsed <= t_now)
-				limit_exceeded
-					("time elapsed limit (%lu seconds) exceeded",
-					 wlimit.time_elapsed);
+/*
+ * Once the child process is gone, processes it left behind are given
+ * exit_grace_time to exit, then the child process tree is killed.
+ * Whatever is still there KILL_WAIT_MS later is abandoned.
+ */
+#define	KILL_WAIT_MS	1000
+
+static int grace_armed, tree_abandoned;
+
+static void
+grace_start(void)
+{
+	if (grace_armed || grace_w.fd < 0)
+		return;
+	grace_armed = 1;
+	timer_arm(grace_w.fd, exit_grace_time * 1000000ULL, 0);
+}
+
+static void
+handle_grace(ev_watch_t w)
+{
+	if (!(w->ready & EV_READ) || !timer_expirations(w) || !tree_alive)
+		return;
+
+	if (kill_fd >= 0)
+	{
+		kill_tree();
+		timer_arm(w->fd, KILL_WAIT_MS * 1000000ULL, 0);
+	} else
+		tree_abandoned = 1;
+}
+
+static void
+handle_child_exit(ev_watch_t w)
+{
+	if (!(w->ready & EV_READ))
+		return;
+	w->ready &= ~EV_READ;
+
+	(void) drain_signal_fd(w->fd);
+	reap_children();
+	if (!child_pid && tree_alive)
+		grace_start();
+}
+
+/* Wait until the child process tree is gone or abandoned. */
+static void
+wait_tree(void)
+{
+	struct pollfd pfd[2] = {
+		{.fd = child_w.fd,.events = POLLIN},
+		{.fd = grace_w.fd,.events = POLLIN}
+	};
+
+	grace_start();
+	while (tree_alive && !tree_abandoned)
+	{
+		if (TEMP_FAILURE_RETRY(poll(pfd, 2, -1)) < 0)
+			error(EXIT_FAILURE, errno, "poll");
+		if (pfd[0].revents)
+		{
+			child_w.ready |= EV_READ;
+			handle_child_exit(&child_w);
 		}
+		if (pfd[1].revents)
+		{
+			grace_w.ready |= EV_READ;
+			handle_grace(&grace_w);
+		}
+	}
+}
+
+/*
+ * Output rate limits: each child output stream has a token bucket of
+ * wlimit.rate_burst bytes refilled at wlimit.rate_bytes per second.
+ * A stream out of tokens is not read until the bucket refills, so the
+ * child is slowed down by its full pipe and no output is lost.
+ */
+struct rate
+{
+	ev_watch_t w;
+	double  tokens;
+	struct timespec stamp;
+	int     paused;
+};
+
+enum
+{
+	STREAM_OUT,
+	STREAM_ERR,
+	STREAM_TTY
+};
+
+static struct rate rate_list[3];
+static struct ev_watch rate_w;
+static unsigned long rate_burst;
+static int rate_armed;
+
+static void
+rate_init(struct rate *r, ev_watch_t w)
+{
+	r->w = w;
+	r->tokens = (double) rate_burst;
+	r->paused = 0;
+	if (clock_gettime(CLOCK_MONOTONIC, &r->stamp) < 0)
+		error(EXIT_FAILURE, errno, "clock_gettime");
+}
+
+/* Resume a paused stream only once it may relay a reasonable chunk. */
+static double
+rate_threshold(void)
+{
+	return (double) (rate_burst < RELAY_BUFSIZE_MIN ?
+			 rate_burst : RELAY_BUFSIZE_MIN);
+}
+
+static void
+rate_pause(struct rate *r)
+{
+	r->paused = 1;
+	if (rate_armed)
+		return;
+
+	double  wait = (rate_threshold() - r->tokens) /
+		(double) wlimit.rate_bytes;
+
+	timer_arm(rate_w.fd, (unsigned long long) (wait * 1e9) + 1, 0);
+	rate_armed = 1;
+}
+
+/* Return how many bytes the stream may relay now, 0 if it is paused. */
+static size_t
+rate_avail(struct rate *r)
+{
+	struct timespec now;
+
+	if (!wlimit.rate_bytes)
+		return (size_t) -1;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &now) < 0)
+		error(EXIT_FAILURE, errno, "clock_gettime");
+	r->tokens += ((double) (now.tv_sec - r->stamp.tv_sec) +
+		      (double) (now.tv_nsec - r->stamp.tv_nsec) / 1e9) *
+		(double) wlimit.rate_bytes;
+	r->stamp = now;
+	if (r->tokens > (double) rate_burst)
+		r->tokens = (double) rate_burst;
+
+	if (r->tokens < (r->paused ? rate_threshold() : 1))
+	{
+		rate_pause(r);
+		return 0;
 	}
 
+	r->paused = 0;
+	return (size_t) r->tokens;
+}
+
+static void
+rate_take(struct rate *r, size_t n)
+{
+	if (wlimit.rate_bytes)
+		r->tokens -= (double) n;
+}
+
+static void
+handle_rate(ev_watch_t w)
+{
+	size_t  i;
+
+	if (!(w->ready & EV_READ) || !timer_expirations(w))
+		return;
+	rate_armed = 0;
+
+	/* Let paused streams check their buckets again. */
+	for (i = 0; i < sizeof(rate_list) / sizeof(rate_list[0]); ++i)
+		if (rate_list[i].paused && rate_list[i].w
+		    && (rate_list[i].w->ready & EV_READ))
+			ev_pend(rate_list[i].w);
+}
+
+/*
+ * Output coalescing: a child output pipe holding less than COALESCE_SIZE
+ * bytes is left alone for up to coalesce_time milliseconds, so that
+ * output written by the child in small pieces is relayed at once.
+ * The pipe itself is the buffer.  In pty mode, output is never held.
+ */
+#define	COALESCE_SIZE	4096
+
+struct hold
+{
+	ev_watch_t w;
+	int     held, due;
+};
+
+static struct hold hold_list[2];
+static struct ev_watch hold_w;
+static int hold_armed;
+
+/* Return nonzero if the stream is to be left alone for now. */
+static int
+hold_output(struct hold *h)
+{
+	int     avail;
+
+	if (!h || hold_w.fd < 0)
+		return 0;
+
+	if (h->due)
+	{
+		h->due = 0;
+		return 0;
+	}
+
+	/* Enough output and the end of file are relayed right away. */
+	if ((h->w->ready & EV_HUP)
+	    || ioctl(h->w->fd, FIONREAD, &avail) < 0
+	    || avail <= 0 || avail >= COALESCE_SIZE)
+	{
+		h->held = 0;
+		return 0;
+	}
+
+	h->held = 1;
+	if (!hold_armed)
+	{
+		timer_arm(hold_w.fd, coalesce_time * 1000000ULL, 0);
+		hold_armed = 1;
+	}
 	return 1;
 }
 
+static void
+handle_hold(ev_watch_t w)
+{
+	size_t  i;
+
+	if (!(w->ready & EV_READ) || !timer_expirations(w))
+		return;
+	hold_armed = 0;
+
+	for (i = 0; i < sizeof(hold_list) / sizeof(hold_list[0]); ++i)
+	{
+		struct hold *h = &hold_list[i];
+
+		if (!h->held)
+			continue;
+		h->held = 0;
+		h->due = 1;
+		if (h->w->ready & EV_READ)
+			ev_pend(h->w);
+	}
+}
+
+static void
+start_timers(void)
+{
+	if (wlimit.time_elapsed)
+		ev_add(&elapsed_w,
+		       timer_fd(wlimit.time_elapsed * 1000000ULL, 0),
+		       EV_READ | EV_AUX, handle_elapsed, 0);
+
+	if (wlimit.time_idle)
+		ev_add(&idle_w,
+		       timer_fd(wlimit.time_idle * 1000000ULL / IDLE_TICKS, 1),
+		       EV_READ | EV_AUX, handle_idle, 0);
+
+	if (wlimit.rate_bytes)
+	{
+		rate_burst = wlimit.rate_burst ? : wlimit.rate_bytes;
+		ev_add(&rate_w, timer_fd(0, 0), EV_READ | EV_AUX,
+		       handle_rate, 0);
+	}
+
+	/* Interactive sessions, hybrid ones included, are never delayed. */
+	if (coalesce_time && !use_pty)
+		ev_add(&hold_w, timer_fd(0, 0), EV_READ | EV_AUX,
+		       handle_hold, 0);
+	else
+		hold_w.fd = -1;
+}
+
 struct io_std
 {
-	int     master_read_fd, master_write_out_fd, master_write_err_fd;
-	int     slave_read_out_fd, slave_read_err_fd, slave_write_fd;
-	size_t  master_avail, slave_avail;
-	char    master_buf[BUFSIZ], slave_buf[BUFSIZ];
+	/*
+	 * In pty mode, the master pty is used for both directions.
+	 * If only stdin of the child is the pty, child output comes from
+	 * the pipes, and slave_tty is the master pty, still read for what
+	 * is written to the terminal, like echo and prompts.
+	 * Otherwise, the stdin feed, if any, is read by master_read
+	 * and written to the child stdin pipe by slave_feed.
+	 */
+	struct ev_watch master_read, slave_read_out, slave_read_err;
+	struct ev_watch slave_feed, slave_tty;
+	ev_watch_t slave_write;
+	int     master_write_out_fd, master_write_err_fd;
+	int     feed_fd;
+	int     splice_in, splice_out, splice_err, splice_tty;
+	ring_t  master_ring, slave_out_ring, slave_err_ring, slave_tty_ring;
 };
 
 typedef struct io_std *io_std_t;
 
-static int pty_fd = -1, ctl_fd = -1, x11_fd = -1, log_fd = -1;
-static unsigned long total_bytes_read, total_bytes_written;
+static int io_failed;
+static struct ev_watch ctl_w, x11_w, log_w, journal_w;
 
 static char *x11_saved_data, *x11_fake_data;
 
@@ -234,7 +649,7 @@ handle_x11_ctl(void)
 	}
 
 	x11_fake_data = xmalloc(x11_data_len);
-	int     fd = fd_recv(ctl_fd, x11_fake_data, x11_data_len);
+	int     fd = fd_recv(ctl_w.fd, x11_fake_data, x11_data_len);
 
 	if (fd >= 0)
 		fd = x11_check_listen(fd);
@@ -256,180 +671,520 @@ handle_x11_ctl(void)
 	return fd;
 }
 
+/* Return how much may be spliced without exceeding the bytes written limit. */
+static size_t
+splice_count(void)
+{
+	size_t  count = relay_bufsize_max;
+
+	if (wlimit.bytes_written)
+	{
+		if (total_bytes_written >= wlimit.bytes_written)
+			return 0;
+		if (wlimit.bytes_written - total_bytes_written < count)
+			count = wlimit.bytes_written - total_bytes_written;
+	}
+
+	return count;
+}
+
 static int
-handle_io(io_std_t io)
+caller_writable(int fd)
 {
+	struct pollfd pfd = {.fd = fd,.events = POLLOUT };
+
+	return TEMP_FAILURE_RETRY(poll(&pfd, 1, 0)) > 0;
+}
+
+static void
+relay_slave_output(ev_watch_t w, ring_t *r, int out_fd, int *use_splice,
+		   struct rate *rate, struct hold *hold)
+{
+	size_t  count, limit;
 	ssize_t n;
-	int     rc;
-	int     max_fd = 0;
-	fd_set  read_fds, write_fds;
+	stats_source_t *stats = &relay_stats.source[out_fd == STDOUT_FILENO ?
+						     CHAN_STDOUT : CHAN_STDERR];
+
+	if (!(w->ready & EV_READ))
+		return;
+
+	/* Leave the data in the pipe until the rate limit allows it. */
+	if (!(limit = rate_avail(rate)))
+		return;
 
-	FD_ZERO(&read_fds);
-	FD_ZERO(&write_fds);
+	/* Leave small output in the pipe for a while to relay it at once. */
+	if (hold_output(hold))
+		return;
 
-	if (sigwinch_arrived)
+	/*
+	 * While nothing is queued for the caller, move data from the child
+	 * pipe straight to the caller descriptor.
+	 */
+	if (*use_splice && outq_idle(out_fd))
 	{
-		sigwinch_arrived = 0;
-		(void) tty_copy_winsize(STDIN_FILENO, pty_fd);
+		/* Leave the rest to work_limits_ok(). */
+		if (!(count = splice_count()))
+			return;
+		if (count > limit)
+			count = limit;
+
+		n = splice(w->fd, 0, out_fd, 0, count,
+			   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		++stats->splices;
+		if (n > 0)
+		{
+			stats->bytes += (unsigned long long) n;
+			++relay_stats.sink[out_fd - 1].writes;
+			relay_stats.sink[out_fd - 1].bytes +=
+				(unsigned long long) n;
+			/* A short splice does not mean the pipe is drained. */
+			total_bytes_written += (unsigned long) n;
+			rate_take(rate, (size_t) n);
+			return;
+		}
+		if (n == 0)
+		{
+			ev_del(w);
+			return;
+		}
+
+		if (errno == EINVAL)
+		{
+			/* Caller descriptor does not support splice. */
+			*use_splice = 0;
+		} else if (errno != EAGAIN)
+			error(EXIT_FAILURE, errno, "splice");
+		else if (caller_writable(out_fd))
+		{
+			/* The child pipe is drained. */
+			w->ready &= ~EV_READ;
+			return;
+		} else
+			outq_busy(out_fd);
+
+		/* Otherwise copy the output and queue it for the caller. */
 	}
 
-	/* Select child output, error, log and x11 descriptors
-	   even after child process completion. */
-	fds_add_fd(&read_fds, &max_fd, io->slave_read_out_fd);
-	fds_add_fd(&read_fds, &max_fd, io->slave_read_err_fd);
-	fds_add_log(&read_fds, &max_fd);
-	fds_add_x11(&read_fds, &write_fds, &max_fd);
+	/* The ring is always empty here, so the data read is contiguous. */
+	count = ring_space(r);
+	if (count > limit)
+		count = limit;
+	n = ring_read_max(r, w->fd, count);
+	ev_read_done(w, n, count);
+	++stats->reads;
+	if (n > 0)
+	{
+		stats->bytes += (unsigned long long) n;
+		const char *data = ring_data(r, &count);
 
-	if (child_pid)
+		rate_take(rate, count);
+
+		xwrite_all(out_fd, data, count);
+		ring_drop(r, count);
+	} else if (n == 0 || errno != EAGAIN)
+		ev_del(w);
+}
+
+static int feed_flags = -1;
+
+static void
+restore_feed(void)
+{
+	if (feed_flags >= 0)
+		(void) fcntl(STDIN_FILENO, F_SETFL, feed_flags);
+	feed_flags = -1;
+}
+
+/*
+ * Switch the stdin feed, or caller stdin read in pty mode, to
+ * non-blocking mode, caller stdin for a while.
+ */
+static void
+feed_init(int fd)
+{
+	if (fd == STDIN_FILENO)
 	{
-		/* Select child input, tty input and listeners
-		   only if child process is alive. */
-		if (io->master_avail)
-			fds_add_fd(&write_fds, &max_fd, io->slave_write_fd);
-		else
-			fds_add_fd(&read_fds, &max_fd, io->master_read_fd);
+		if ((feed_flags = fcntl(fd, F_GETFL)) < 0)
+			error(EXIT_FAILURE, errno, "fcntl F_GETFL");
+		if (atexit(restore_feed))
+			error(EXIT_FAILURE, errno, "atexit");
+	}
+	unblock_fd(fd);
+}
 
-		fds_add_fd(&read_fds, &max_fd, log_fd);
-		fds_add_fd(&read_fds, &max_fd, ctl_fd);
-		fds_add_fd(&read_fds, &max_fd, x11_fd);
-	} else
+/* Stop feeding the child, so that it sees the end of its stdin. */
+static void
+stop_feed(io_std_t io)
+{
+	ev_del(&io->master_read);
+	if (io->feed_fd > STDERR_FILENO)
+		(void) close(io->feed_fd);
+	io->feed_fd = -1;
+
+	close_watch(&io->slave_feed);
+	io->slave_write = 0;
+	io->splice_in = 0;
+	ring_drop(&io->master_ring, ring_used(&io->master_ring));
+}
+
+/* Move the stdin feed straight to the child stdin pipe. */
+static void
+splice_feed(io_std_t io)
+{
+	ev_watch_t in = &io->slave_feed;
+	stats_source_t *stats = &relay_stats.source[STATS_INPUT];
+	size_t  count = relay_bufsize_max;
+	ssize_t n;
+
+	if (!child_pid || !(io->master_read.ready & EV_READ)
+	    || !(in->ready & EV_WRITE))
+		return;
+
+	if (wlimit.bytes_read)
 	{
-		/* No child process and no descriptors to handle? */
-		if (max_fd <= 1)
-			return EXIT_FAILURE;
+		/* Leave the rest to work_limits_ok(). */
+		if (total_bytes_read >= wlimit.bytes_read)
+			return;
+		if (wlimit.bytes_read - total_bytes_read < count)
+			count = wlimit.bytes_read - total_bytes_read;
 	}
 
-	rc = xselect(max_fd + 1, &read_fds, &write_fds, wlimit.time_idle);
-	if (!rc)
-		limit_exceeded("idle time limit (%lu seconds) exceeded",
-			       wlimit.time_idle);
-	else if (rc < 0)
-		return (errno == EINTR) ? EXIT_SUCCESS : EXIT_FAILURE;
+	n = splice(io->master_read.fd, 0, in->fd, 0, count,
+		   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	++stats->splices;
+	if (n > 0)
+	{
+		stats->bytes += (unsigned long long) n;
+		total_bytes_read += (unsigned long) n;
+		idle_input = 1;
+		return;
+	}
+	if (n == 0)
+	{
+		stop_feed(io);
+		return;
+	}
 
-	if (fds_isset(&read_fds, io->slave_read_err_fd))
+	if (errno == EINVAL)
 	{
-		/* handle child stderr */
-		n = read_retry(io->slave_read_err_fd,
-			       io->slave_buf, sizeof io->slave_buf);
-		if (n <= 0)
-		{
-			io->slave_read_err_fd = -1;
-		} else
+		/* The feed does not support splice, copy it. */
+		io->splice_in = 0;
+	} else if (errno == EPIPE)
+		stop_feed(io);
+	else if (errno != EAGAIN)
+		error(EXIT_FAILURE, errno, "splice");
+	else if (caller_writable(in->fd))
+		io->master_read.ready &= ~EV_READ;
+	else
+		in->ready &= ~EV_WRITE;
+}
+
+static void
+handle_std(ev_watch_t w)
+{
+	io_std_t io = w->data;
+	ev_watch_t in = io->slave_write;
+	size_t  len;
+	ssize_t n;
+
+	/* handle child stderr */
+	relay_slave_output(&io->slave_read_err, &io->slave_err_ring,
+			   io->master_write_err_fd, &io->splice_err,
+			   &rate_list[STREAM_ERR], &hold_list[STREAM_ERR]);
+
+	/* handle child stdout */
+	relay_slave_output(&io->slave_read_out, &io->slave_out_ring,
+			   io->master_write_out_fd, &io->splice_out,
+			   &rate_list[STREAM_OUT], &hold_list[STREAM_OUT]);
+
+	/* handle child terminal output */
+	relay_slave_output(&io->slave_tty, &io->slave_tty_ring,
+			   io->master_write_out_fd, &io->splice_tty,
+			   &rate_list[STREAM_TTY], 0);
+
+	if (io->splice_in)
+		splice_feed(io);
+
+	if (child_pid && !io->splice_in
+	    && (len = ring_space(&io->master_ring))
+	    && (io->master_read.ready & EV_READ))
+	{
+		/* handle tty input or stdin feed */
+		n = ring_read(&io->master_ring, io->master_read.fd);
+		ev_read_done(&io->master_read, n, len);
+		++relay_stats.source[STATS_INPUT].reads;
+		if (n > 0)
 		{
-			xwrite_all(io->master_write_err_fd, io->slave_buf,
-				   (size_t) n);
+			relay_stats.source[STATS_INPUT].bytes +=
+				(unsigned long long) n;
+			idle_input = 1;
 		}
+		if (n == 0 && use_pty)
+			ring_put(&io->master_ring, "\4", 1);
+		else if (n == 0 || (n < 0 && errno != EAGAIN))
+			ev_del(&io->master_read);
 	}
 
-	if (fds_isset(&read_fds, io->slave_read_out_fd))
+	if (child_pid && (len = ring_used(&io->master_ring))
+	    && in && (in->ready & EV_WRITE))
 	{
-		/* handle child stdout */
-		n = read_retry(io->slave_read_out_fd,
-			       io->slave_buf, sizeof io->slave_buf);
-		if (n <= 0)
+		/* handle child input */
+		n = ring_write(&io->master_ring, in->fd);
+		ev_write_done(in, n, len);
+		if (n < 0 && errno == EAGAIN)
+			n = 0;
+		else if (n < 0 && errno == EPIPE && in == &io->slave_feed)
 		{
-			io->slave_read_out_fd = -1;
-		} else
+			/* The child does not want any more input. */
+			stop_feed(io);
+			in = 0;
+			n = 0;
+		} else if (n <= 0)
 		{
-			xwrite_all(io->master_write_out_fd, io->slave_buf,
-				   (size_t) n);
+			io_failed = 1;
+			return;
 		}
+
+		total_bytes_read += (unsigned long) n;
 	}
 
-	if (io->master_avail && fds_isset(&write_fds, io->slave_write_fd))
+	/* The feed is over once what was read from it is written out. */
+	if (in == &io->slave_feed && io->master_read.fd < 0
+	    && !ring_used(&io->master_ring))
 	{
-		/* handle child input */
-		n = write_loop(io->slave_write_fd,
-			       io->master_buf, io->master_avail);
-		if (n <= 0)
-			return EXIT_FAILURE;
+		stop_feed(io);
+		in = 0;
+	}
 
-		if ((size_t) n < io->master_avail)
-		{
-			memmove(io->master_buf,
-				io->master_buf + (size_t) n,
-				io->master_avail - (size_t) n);
-		}
+	/* Come back for whatever is still ready to be relayed. */
+	if ((io->slave_read_err.ready & EV_READ) && !rate_list[STREAM_ERR].paused
+	    && !hold_list[STREAM_ERR].held)
+		ev_pend(&io->slave_read_err);
+	if ((io->slave_read_out.ready & EV_READ) && !rate_list[STREAM_OUT].paused
+	    && !hold_list[STREAM_OUT].held)
+		ev_pend(&io->slave_read_out);
+	if ((io->slave_tty.ready & EV_READ) && !rate_list[STREAM_TTY].paused)
+		ev_pend(&io->slave_tty);
+	if (child_pid && in && ring_used(&io->master_ring)
+	    && (in->ready & EV_WRITE))
+		ev_pend(in);
+	if (child_pid && ring_space(&io->master_ring)
+	    && (io->master_read.ready & EV_READ)
+	    && (!io->splice_in || (in->ready & EV_WRITE)))
+		ev_pend(&io->master_read);
+}
 
-		total_bytes_read += io->master_avail;
-		io->master_avail -= (size_t) n;
-	}
+static void
+handle_ctl(ev_watch_t w)
+{
+	if (!(w->ready & EV_READ))
+		return;
+
+	int     x11_fd = handle_x11_ctl();
 
-	if (!io->master_avail && fds_isset(&read_fds, io->master_read_fd))
+	if (x11_fd < 0)
 	{
-		/* handle tty input */
-		n = read_retry(io->master_read_fd,
-			       io->master_buf, sizeof io->master_buf);
-		if (n > 0)
-			io->master_avail = (size_t) n;
-		else if (n == 0)
-		{
-			io->master_buf[0] = 4;
-			io->master_avail = 1;
-		} else
-			io->master_read_fd = -1;
+		x11_closedir();
+		error(EXIT_SUCCESS, 0, "X11 forwarding disabled\r");
+		relay_event(CHAN_X11, "X11 forwarding disabled");
+	} else
+	{
+		unblock_fd(x11_fd);
+		x11_set_auth_data(x11_saved_data, x11_fake_data);
+		if (!io_thread_x11(x11_fd))
+			ev_add(&x11_w, x11_fd, EV_READ, x11_handle_new, 0);
+		relay_event(CHAN_X11, "X11 forwarding enabled");
 	}
 
-	x11_handle_select(&read_fds, &write_fds, x11_saved_data,
-			  x11_fake_data);
-	x11_handle_new(x11_fd, &read_fds);
+	int     fd = w->fd;
 
-	log_handle_select(&read_fds);
-	log_handle_new(log_fd, &read_fds);
+	ev_del(w);
+	(void) close(fd);
+}
 
-	if (fds_isset(&read_fds, ctl_fd))
+/*
+ * Once the child process is gone, stop listening to new connections
+ * and to tty input; child output, log and x11 connections are still
+ * drained.
+ */
+static void
+forget_listeners(io_std_t io)
+{
+	if (io->slave_write == &io->slave_feed)
+		stop_feed(io);
+	ev_del(&io->master_read);
+	/* Log listeners of the relay thread are its own to forget. */
+	if (!io_thread_forget())
 	{
-		if ((x11_fd = handle_x11_ctl()) < 0)
-		{
-			x11_closedir();
-			error(EXIT_SUCCESS, 0, "X11 forwarding disabled\r");
-		}
-		(void) close(ctl_fd);
-		ctl_fd = -1;
+		log_forget(&log_w);
+		log_forget(&journal_w);
 	}
+	ev_del(&ctl_w);
+	ev_del(&x11_w);
+	close_watch(&winch_w);
+}
+
+static int
+handle_io(io_std_t io)
+{
+	int     rc;
+
+	if (!child_pid)
+	{
+		forget_listeners(io);
 
-	return EXIT_SUCCESS;
+		/* No child process and no descriptors to handle? */
+		if (!ev_input_count())
+			return EXIT_FAILURE;
+	}
+
+	rc = ev_poll(-1);
+	++relay_stats.wakeups;
+	if (rc > 0)
+		relay_stats.events += (unsigned long long) rc;
+	else if (rc < 0)
+		return (errno == EINTR) ? EXIT_SUCCESS : EXIT_FAILURE;
+
+	ev_dispatch();
+	log_flush();
+
+	return (io_failed || tree_abandoned) ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
+/*
+ * In framed output mode, everything goes to the caller stdout as frames.
+ * Each frame starts with a 16-byte header: channel number (1 byte),
+ * 3 zero bytes, payload length (4 bytes) and CLOCK_MONOTONIC timestamp
+ * in nanoseconds (8 bytes), both in network byte order.
+ */
 void
-xwrite_all(int fd, const char *buffer, size_t count)
+frame_header(unsigned char *hdr, unsigned chan, size_t count)
 {
-	if (write_loop(fd, buffer, count) != (ssize_t) count)
-		error(EXIT_FAILURE, errno, "write");
+	struct timespec ts;
+	uint64_t stamp;
+	int     i;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		error(EXIT_FAILURE, errno, "clock_gettime");
+	stamp = (uint64_t) ts.tv_sec * 1000000000U + (uint64_t) ts.tv_nsec;
+
+	hdr[0] = (unsigned char) chan;
+	hdr[1] = hdr[2] = hdr[3] = 0;
+	for (i = 0; i < 4; ++i)
+		hdr[4 + i] = (unsigned char) (count >> (24 - 8 * i));
+	for (i = 0; i < 8; ++i)
+		hdr[8 + i] = (unsigned char) (stamp >> (56 - 8 * i));
+}
 
+/* Return the payload length recorded in a frame header. */
+size_t
+frame_length(const unsigned char *hdr)
+{
+	return (size_t) hdr[4] << 24 | (size_t) hdr[5] << 16 |
+		(size_t) hdr[6] << 8 | (size_t) hdr[7];
+}
+
+static void
+write_frame(unsigned chan, const char *buffer, size_t count)
+{
+	unsigned char hdr[FRAME_HEADER_SIZE];
+
+	frame_header(hdr, chan, count);
+	outq_write(STDOUT_FILENO, (const char *) hdr, sizeof(hdr));
+	outq_write(STDOUT_FILENO, buffer, count);
+}
+
+/* Relay child output to the caller. */
+void
+xwrite_chan(unsigned chan, const char *buffer, size_t count)
+{
+	if (io_thread_output(chan, 0, buffer, count))
+		return;
+
+	observe_write(buffer, count);
+	if (quiet_output)
+		quiet_write(chan, buffer, count);
+	else if (framed_output)
+		write_frame(chan, buffer, count);
+	else
+		outq_write(chan == CHAN_STDOUT ? STDOUT_FILENO : STDERR_FILENO,
+			   buffer, count);
+	transcript_write(chan, buffer, count);
+
+	/* The limit is on child output, whether the caller sees it or not. */
 	total_bytes_written += count;
 }
 
+/* Write child output to the transcript only. */
+void
+xwrite_transcript(unsigned chan, const char *buffer, size_t count)
+{
+	if (io_thread_output(chan, -1, buffer, count))
+		return;
+
+	transcript_write(chan, buffer, count);
+}
+
+void
+xwrite_all(int fd, const char *buffer, size_t count)
+{
+	xwrite_chan(fd == STDOUT_FILENO ? CHAN_STDOUT : CHAN_STDERR,
+		    buffer, count);
+}
+
+/* Report an event to the caller, in framed output mode only. */
+void
+relay_event(unsigned chan, const char *fmt, ...)
+{
+	char    buf[BUFSIZ];
+	va_list ap;
+	int     n;
+
+	if (!framed_output)
+		return;
+
+	va_start(ap, fmt);
+	n = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	if (n < 0)
+		return;
+	if ((size_t) n >= sizeof(buf))
+		n = sizeof(buf) - 1;
+
+	if (io_thread_output(chan, 1, buf, (size_t) n))
+		return;
+	write_frame(chan, buf, (size_t) n);
+}
+
 int
-handle_parent(pid_t a_child_pid, int a_pty_fd, int pipe_out, int pipe_err,
-	      int a_ctl_fd)
+handle_parent(pid_t a_child_pid, int a_pty_fd, int pipe_in, int pipe_out,
+	      int pipe_err, int feed_fd, int a_ctl_fd, int a_kill_fd)
 {
 	io_std_t io;
-	struct sigaction act;
 
 	pty_fd = a_pty_fd;
-	ctl_fd = a_ctl_fd;
 
 	child_pid = a_child_pid;
-
-	act.sa_handler = sigchld_handler;
-	sigemptyset(&act.sa_mask);
-	act.sa_flags = (int) (SA_NOCLDSTOP | SA_RESETHAND);
-	if (sigaction(SIGCHLD, &act, 0))
-		error(EXIT_FAILURE, errno, "sigaction");
+	kill_fd = a_kill_fd;
 
 	signal(SIGPIPE, SIG_IGN);
 
-	io = xcalloc(1UL, sizeof(*io));
-	io->master_read_fd = use_pty ? STDIN_FILENO : -1;
-	io->master_write_out_fd = STDOUT_FILENO;
-	io->master_write_err_fd = use_pty ? -1 : STDERR_FILENO;
-	io->slave_read_out_fd = use_pty ? pty_fd : pipe_out;
-	io->slave_read_err_fd = use_pty ? -1 : pipe_err;
-	io->slave_write_fd = use_pty ? pty_fd : -1;
+	ev_init();
+	stats_start();
+
+	/* SIGCHLD is still blocked since fork. */
+	ev_add(&child_w, signal_fd(SIGCHLD), EV_READ | EV_AUX,
+	       handle_child_exit, 0);
+	ev_add(&grace_w, timer_fd(0, 0), EV_READ | EV_AUX, handle_grace, 0);
 
 	if (pty_fd >= 0)
 		unblock_fd(pty_fd);
+	if (pipe_in >= 0)
+	{
+		unblock_fd(pipe_in);
+		feed_init(feed_fd);
+	} else if (use_pty)
+		feed_init(STDIN_FILENO);
 	if (pipe_out >= 0)
 		unblock_fd(pipe_out);
 	if (pipe_err >= 0)
@@ -439,26 +1194,88 @@ handle_parent(pid_t a_child_pid, int a_pty_fd, int pipe_out, int pipe_err,
 	if (init_tty() && tty_copy_winsize(STDIN_FILENO, pty_fd) == 0)
 	{
 		block_signal_handler(SIGWINCH, SIG_BLOCK);
-		act.sa_handler = sigwinch_handler;
-		sigemptyset(&act.sa_mask);
-		act.sa_flags = SA_RESTART;
-		if (sigaction(SIGWINCH, &act, 0))
-			error(EXIT_FAILURE, errno, "sigaction");
+		ev_add(&winch_w, signal_fd(SIGWINCH), EV_READ, handle_winch, 0);
 	}
 
-	log_fd = log_listen();
+	outq_init();
+
+	/*
+	 * The transcript, the framing, the tail and the observers
+	 * need to see the data.
+	 */
+	int     transcript = transcript_start();
+	int     observe = observe_start();
+
+	quiet_init();
+
+	io = xcalloc(1UL, sizeof(*io));
+	ring_init(&io->master_ring, RELAY_BUFSIZE_MIN, relay_bufsize_max);
+	ring_init(&io->slave_out_ring, RELAY_BUFSIZE_MIN, relay_bufsize_max);
+	ring_init(&io->slave_err_ring, RELAY_BUFSIZE_MIN, relay_bufsize_max);
+	ring_init(&io->slave_tty_ring, RELAY_BUFSIZE_MIN, relay_bufsize_max);
+	io->master_write_out_fd = STDOUT_FILENO;
+	io->master_write_err_fd = pipe_out < 0 ? -1 : STDERR_FILENO;
+	int     can_splice = pipe_out >= 0 && !transcript && !observe &&
+		!framed_output && !quiet_output;
+
+	io->splice_out = can_splice && outq_splice_ok(STDOUT_FILENO);
+	io->splice_err = can_splice && outq_splice_ok(STDERR_FILENO);
+	io->feed_fd = feed_fd;
+	io->splice_in = feed_fd >= 0;
+	ev_add(&io->master_read, use_pty ? STDIN_FILENO : feed_fd, EV_READ,
+	       handle_std, io);
+	ev_add(&io->slave_feed, pipe_in, EV_WRITE, handle_std, io);
+	ev_add(&io->slave_read_out, pipe_out < 0 ? pty_fd : pipe_out,
+	       pipe_out < 0 ? EV_READ | EV_WRITE : EV_READ, handle_std, io);
+	ev_add(&io->slave_read_err, pipe_err, EV_READ, handle_std, io);
+	ev_add(&io->slave_tty, use_pty_stdin ? pty_fd : -1,
+	       EV_READ | EV_WRITE, handle_std, io);
+	io->slave_write = use_pty_stdin ? &io->slave_tty :
+		use_pty ? &io->slave_read_out :
+		pipe_in >= 0 ? &io->slave_feed : 0;
+
+	ev_add(&ctl_w, a_ctl_fd, EV_READ, handle_ctl, 0);
+	ev_add(&x11_w, -1, EV_READ, x11_handle_new, 0);
+
+	int     log_fd = log_listen();
+	int     journal_fd = journal_listen();
+
+	if (log_fd >= 0)
+		unblock_fd(log_fd);
+	if (journal_fd >= 0)
+		unblock_fd(journal_fd);
+	if (!io_thread_start(log_fd, journal_fd))
+	{
+		ev_add(&log_w, log_fd, EV_READ, log_handler(log_fd), 0);
+		ev_add(&journal_w, journal_fd, EV_READ, journal_handle, 0);
+	}
+
+	start_timers();
+	rate_init(&rate_list[STREAM_OUT], &io->slave_read_out);
+	rate_init(&rate_list[STREAM_ERR], &io->slave_read_err);
+	rate_init(&rate_list[STREAM_TTY], &io->slave_tty);
+	hold_list[STREAM_OUT].w = &io->slave_read_out;
+	hold_list[STREAM_ERR].w = &io->slave_read_err;
 
 	while (work_limits_ok(total_bytes_read, total_bytes_written))
 		if (handle_io(io) != EXIT_SUCCESS)
 			break;
 
+	io_thread_stop();
+	outq_flush();
+	transcript_finish();
+	observe_finish();
+	ev_fini();
+
 	/* Close master pty descriptor, thus sending HUP to child session. */
 	(void) close(pty_fd);
 
-	dfl_signal_handler(SIGWINCH);
-	wait_child();
-	dfl_signal_handler(SIGCHLD);
+	close_watch(&winch_w);
+	wait_tree();
 	forget_child();
 
+	/* Show the output kept back only if something went wrong. */
+	quiet_flush(child_rc != 0);
+
 	return child_rc;
 }
@@ -28,6 +28,10 @@
 #define	MIN_CHANGE_UID	34
 #define	MIN_CHANGE_GID	34
 #define	MAX_CONFIG_SIZE	16384
+#define	RELAY_BUFSIZE_MIN	8192
+#define	RELAY_BUFSIZE_MAX	(1024 * 1024)
+#define	QUIET_TAIL_SIZE	(1024 * 1024)
+#define	OUTPUT_QUEUE_SIZE	(1024 * 1024)
 
 typedef enum
 {
@@ -54,24 +58,91 @@ typedef struct
 
 typedef struct
 {
-	unsigned long time_elapsed;
-	unsigned long time_idle;
+	unsigned long time_elapsed;	/* in milliseconds */
+	unsigned long time_idle;	/* in milliseconds */
 	unsigned long bytes_read;
 	unsigned long bytes_written;
+	unsigned long rate_bytes;	/* per second, per stream */
+	unsigned long rate_burst;
 } work_limit_t;
 
+typedef struct
+{
+	char   *buf;
+	size_t  size, head, tail;
+	size_t  min_size, max_size;
+	unsigned small_reads;
+} ring_t;
+
+/* Relay statistics: child output sources are indexed by channel. */
+#define	STATS_INPUT	0
+#define	STATS_SOURCES	5
+#define	STATS_SINKS	2
+
+typedef struct
+{
+	unsigned long long bytes, reads, splices;
+} stats_source_t;
+
+typedef struct
+{
+	unsigned long long bytes, writes, queue_max;
+	unsigned long long backlog_ns, blocked_ns;
+} stats_sink_t;
+
+typedef struct
+{
+	stats_source_t source[STATS_SOURCES];
+	stats_sink_t sink[STATS_SINKS];
+	unsigned long long wakeups, events;
+	unsigned long x11_connections, log_connections;
+	unsigned long long log_filtered, log_suppressed;
+} relay_stats_t;
+
 typedef void (*VALIDATE_FPTR)(struct stat *, const char *);
 
+/* Channels of the framed output. */
+#define	CHAN_STDOUT	1U
+#define	CHAN_STDERR	2U
+#define	CHAN_SYSLOG	3U
+#define	CHAN_X11	4U
+#define	CHAN_LIMIT	5U
+
+/* In framed output mode, each frame starts with a header. */
+#define	FRAME_HEADER_SIZE	16
+
+#define	EV_READ		1U
+#define	EV_WRITE	2U
+#define	EV_HUP		4U
+#define	EV_AUX		8U	/* does not keep the relay loop running */
+
+typedef struct ev_watch *ev_watch_t;
+typedef void (*ev_handler_t)(ev_watch_t);
+
+struct ev_watch
+{
+	int     fd;
+	unsigned events, ready;
+	int     pending, polled;
+	ev_handler_t handler;
+	void   *data;
+};
+
 void    sanitize_fds(void);
 void    cloexec_fds(void);
+void    close_fds_except(int keep_fd);
 void    nullify_stdin(void);
+int     caller_open(const char *path, int flags);
+int     caller_listen(const char *path);
 void    unblock_fd(int fd);
-void    fds_add_fd(fd_set *fds, int *max_fd, const int fd);
-int     fds_isset(fd_set *fds, const int fd);
 ssize_t read_retry(int fd, void *buf, size_t count);
 ssize_t write_retry(int fd, const void *buf, size_t count);
 ssize_t write_loop(int fd, const char *buffer, size_t count);
 void    xwrite_all(int fd, const char *buffer, size_t count);
+void    xwrite_chan(unsigned chan, const char *buffer, size_t count);
+void    xwrite_transcript(unsigned chan, const char *buffer, size_t count);
+void    relay_event(unsigned chan, const char *fmt, ...)
+	__attribute__ ((format(printf, 2, 3)));
 int     init_tty(void);
 void    restore_tty(void);
 int     tty_copy_winsize(int master_fd, int slave_fd);
@@ -83,8 +154,9 @@ void    ch_uid(uid_t uid, uid_t *save);
 void    ch_gid(gid_t gid, gid_t *save);
 void    chdiruid(const char *path);
 void    purge_ipc(uid_t uid1, uid_t uid2);
-void    handle_child(char *const *env, int pty_fd, int pipe_out, int pipe_err, int ctl_fd) __attribute__ ((noreturn));
-int     handle_parent(pid_t pid, int pty_fd, int pipe_out, int pipe_err, int ctl_fd);
+int     killuid_helper(uid_t uid, gid_t gid);
+void    handle_child(char *const *env, int pty_fd, int pipe_in, int pipe_out, int pipe_err, int ctl_fd) __attribute__ ((noreturn));
+int     handle_parent(pid_t pid, int pty_fd, int pipe_in, int pipe_out, int pipe_err, int feed_fd, int ctl_fd, int kill_fd);
 void    block_signal_handler(int no, int what);
 void    dfl_signal_handler(int no);
 void    safe_chdir(const char *name, VALIDATE_FPTR validator);
@@ -96,6 +168,7 @@ void    fd_send(int ctl, int pass, const char *data, size_t len);
 int     fd_recv(int ctl, char *data, size_t data_len);
 int     unix_accept(int fd);
 int     log_listen(void);
+int     journal_listen(void);
 void    x11_drop_display(void);
 int     x11_parse_display(void);
 int     x11_prepare_connect(void);
@@ -104,15 +177,79 @@ int     x11_listen(void);
 int     x11_connect(void);
 int     x11_check_listen(int fd);
 
-void    log_handle_new(const int log_fd, fd_set *read_fds);
-void    fds_add_log(fd_set *read_fds, int *max_fd);
-void    log_handle_select(fd_set *read_fds);
+void    ev_init(void);
+void    ev_fini(void);
+void    ev_add(ev_watch_t w, int fd, unsigned events,
+	       ev_handler_t handler, void *data);
+void    ev_del(ev_watch_t w);
+void    ev_pend(ev_watch_t w);
+size_t  ev_input_count(void);
+void    ev_read_done(ev_watch_t w, ssize_t n, size_t size);
+void    ev_write_done(ev_watch_t w, ssize_t n, size_t size);
+int     ev_poll(int timeout);
+void    ev_dispatch(void);
+
+void    ring_init(ring_t *r, size_t size, size_t max_size);
+void    ring_free(ring_t *r);
+size_t  ring_used(const ring_t *r);
+size_t  ring_space(const ring_t *r);
+char   *ring_data(const ring_t *r, size_t *len);
+void    ring_put(ring_t *r, const char *data, size_t len);
+void    ring_drop(ring_t *r, size_t len);
+void    ring_peek(const ring_t *r, char *buf, size_t len);
+ssize_t ring_read(ring_t *r, int fd);
+ssize_t ring_read_max(ring_t *r, int fd, size_t max);
+ssize_t ring_pread(ring_t *r, int fd, off_t offset);
+ssize_t ring_write(ring_t *r, int fd);
+
+void    outq_init(void);
+void    outq_write(int fd, const char *buffer, size_t count);
+int     outq_idle(int fd);
+int     outq_splice_ok(int fd);
+void    outq_busy(int fd);
+void    outq_flush(void);
+int     spill_open(void);
+
+void    frame_header(unsigned char *hdr, unsigned chan, size_t count);
+size_t  frame_length(const unsigned char *hdr);
+
+void    stats_open(void);
+void    stats_start(void);
+void    stats_report(void);
+unsigned long long stats_now(void);
+
+void    quiet_init(void);
+void    quiet_write(unsigned chan, const char *buffer, size_t count);
+void    quiet_flush(int failed);
+
+void    transcript_open(void);
+int     transcript_start(void);
+void    transcript_write(unsigned chan, const char *data, size_t count);
+void    transcript_finish(void);
+
+void    observe_open(void);
+int     observe_start(void);
+void    observe_write(const char *buffer, size_t count);
+void    observe_finish(void);
+
+void    log_handle_new(ev_watch_t w);
+void    log_handle_select(ev_watch_t w);
+ev_handler_t log_handler(int fd);
+void    log_forget(ev_watch_t w);
+void    log_flush(void);
+void    log_queue(pid_t pid, const char *msg, size_t n);
+void    journal_handle(ev_watch_t w);
 
-void    x11_handle_new(const int x11_fd, fd_set *read_fds);
-void    fds_add_x11(fd_set *read_fds, fd_set *write_fds, int *max_fd);
-void    x11_handle_select(fd_set *read_fds, fd_set *write_fds,
-			  const char *x11_saved_data,
+void    x11_handle_new(ev_watch_t w);
+void    x11_handle_select(ev_watch_t w);
+void    x11_set_auth_data(const char *x11_saved_data,
 			  const char *x11_fake_data);
+int     io_thread_start(int log_fd, int journal_fd);
+int     io_thread_x11(int fd);
+int     io_thread_forget(void);
+void    io_thread_stop(void);
+int     io_thread_output(unsigned chan, int event, const char *buffer,
+			 size_t count);
 
 int	test_unshare_mount(void);
 void	setup_mountpoints(void);
@@ -143,8 +280,24 @@ extern const char *requested_mountpoints;
 
 extern const char *term;
 extern const char *x11_display, *x11_key;
+extern const char *transcript_path;
+extern const char *stdin_feed;
+extern const char *observe_socket;
 
-extern int allow_tty_devices, use_pty;
+extern int allow_tty_devices, use_pty, use_pty_stdin;
+extern int transcript_compress;
+extern int transcript_index;
+extern int relay_thread;
+extern int log_dgram;
+extern int log_priority, log_keep_filtered;
+extern int journal_socket;
+extern const char *journal_fields;
+extern int framed_output;
+extern int quiet_output, quiet_spool;
+extern size_t quiet_tail_size;
+extern const char *relay_stats_dest;
+extern int relay_stats_json;
+extern relay_stats_t relay_stats;
 extern size_t x11_data_len;
 extern int share_caller_network;
 extern int unshared_mount;
@@ -167,5 +320,10 @@ extern mode_t change_umask;
 extern int change_nice;
 extern change_rlimit_t change_rlimit[];
 extern work_limit_t wlimit;
+extern size_t relay_bufsize_max;
+extern size_t output_queue_size;
+extern unsigned long exit_grace_time;
+extern unsigned long coalesce_time;
+extern unsigned long log_rate, log_burst;
 
 #endif /* PKG_BUILD_PRIV_H */
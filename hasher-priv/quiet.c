@@ -0,0 +1,236 @@
+/*
+  Copyright (C) 2026  agent <agent@local>
+
+  The chrootuid parent quiet output mode for the hasher-priv program.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Code in this file may be executed with caller privileges. */
+
+/*
+ * In quiet output mode, child output is kept back instead of being
+ * relayed: the last quiet_tail_size bytes are kept in a memory ring,
+ * and, if quiet_spool is enabled, all of it is also appended to an
+ * unlinked temporary file.  The output is written to the caller only
+ * if the child fails or a work limit is exceeded.
+ *
+ * Chunks are stored as frames, so that the channel of each chunk is
+ * known on replay and whole chunks are discarded from the ring.
+ */
+
+#include <errno.h>
+#include <error.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "priv.h"
+#include "xmalloc.h"
+
+#define	QUIET_REPLAY_SIZE	(64 * 1024)
+
+static ring_t tail;
+static int spool_fd = -1;
+static off_t spool_size;
+
+void
+quiet_init(void)
+{
+	if (!quiet_output)
+		return;
+
+	ring_init(&tail, quiet_tail_size, quiet_tail_size);
+
+	/* Without the spool, the tail is still there. */
+	if (quiet_spool)
+		spool_fd = spill_open();
+}
+
+static void
+spool_write(const unsigned char *hdr, const char *buffer, size_t count)
+{
+	struct iovec iov[2] = {
+		{(void *) hdr, FRAME_HEADER_SIZE},
+		{(void *) buffer, count}
+	};
+	size_t  len = FRAME_HEADER_SIZE + count;
+	ssize_t n = TEMP_FAILURE_RETRY(pwritev(spool_fd, iov, 2, spool_size));
+
+	if (n == (ssize_t) len)
+	{
+		spool_size += n;
+		return;
+	}
+
+	if (n >= 0)
+		errno = ENOSPC;
+	error(EXIT_SUCCESS, errno, "quiet spool write");
+	fputc('\r', stderr);
+	(void) close(spool_fd);
+	spool_fd = -1;
+}
+
+static void
+tail_write(unsigned chan, const char *buffer, size_t count)
+{
+	unsigned char hdr[FRAME_HEADER_SIZE];
+	size_t  max = tail.size - FRAME_HEADER_SIZE;
+
+	/* Keep the end of a chunk which is larger than the ring. */
+	if (count > max)
+	{
+		buffer += count - max;
+		count = max;
+	}
+	frame_header(hdr, chan, count);
+
+	/* Forget the oldest chunks to make room. */
+	while (ring_space(&tail) < FRAME_HEADER_SIZE + count)
+	{
+		unsigned char old[FRAME_HEADER_SIZE];
+
+		ring_peek(&tail, (char *) old, sizeof(old));
+		ring_drop(&tail, FRAME_HEADER_SIZE + frame_length(old));
+	}
+
+	ring_put(&tail, (const char *) hdr, sizeof(hdr));
+	ring_put(&tail, buffer, count);
+}
+
+void
+quiet_write(unsigned chan, const char *buffer, size_t count)
+{
+	if (spool_fd >= 0)
+	{
+		unsigned char hdr[FRAME_HEADER_SIZE];
+
+		frame_header(hdr, chan, count);
+		spool_write(hdr, buffer, count);
+	}
+
+	tail_write(chan, buffer, count);
+}
+
+static int
+replay_fd(const unsigned char *hdr)
+{
+	if (framed_output)
+	{
+		outq_write(STDOUT_FILENO, (const char *) hdr, FRAME_HEADER_SIZE);
+		return STDOUT_FILENO;
+	}
+
+	return hdr[0] == CHAN_STDOUT ? STDOUT_FILENO : STDERR_FILENO;
+}
+
+static void
+replay_tail(void)
+{
+	while (ring_used(&tail))
+	{
+		unsigned char hdr[FRAME_HEADER_SIZE];
+		size_t  len;
+		int     fd;
+
+		ring_peek(&tail, (char *) hdr, sizeof(hdr));
+		ring_drop(&tail, sizeof(hdr));
+		len = frame_length(hdr);
+		fd = replay_fd(hdr);
+
+		while (len)
+		{
+			size_t  n;
+			const char *data = ring_data(&tail, &n);
+
+			if (n > len)
+				n = len;
+			outq_write(fd, data, n);
+			ring_drop(&tail, n);
+			len -= n;
+		}
+	}
+}
+
+static void
+spool_read(char *buf, size_t count, off_t offset)
+{
+	ssize_t n;
+
+	while (count)
+	{
+		n = TEMP_FAILURE_RETRY(pread(spool_fd, buf, count, offset));
+		if (n <= 0)
+			error(EXIT_FAILURE, n ? errno : 0, "quiet spool read");
+		buf += n;
+		count -= (size_t) n;
+		offset += n;
+	}
+}
+
+static void
+replay_spool(void)
+{
+	char   *buf = xmalloc(QUIET_REPLAY_SIZE);
+	off_t   offset = 0;
+
+	while (offset < spool_size)
+	{
+		unsigned char hdr[FRAME_HEADER_SIZE];
+		size_t  len;
+		int     fd;
+
+		spool_read((char *) hdr, sizeof(hdr), offset);
+		offset += (off_t) sizeof(hdr);
+		len = frame_length(hdr);
+		fd = replay_fd(hdr);
+
+		while (len)
+		{
+			size_t  n = len < QUIET_REPLAY_SIZE ?
+				len : QUIET_REPLAY_SIZE;
+
+			spool_read(buf, n, offset);
+			outq_write(fd, buf, n);
+			offset += (off_t) n;
+			len -= n;
+		}
+	}
+
+	free(buf);
+}
+
+/* Write out the output kept back if FAILED, then forget it. */
+void
+quiet_flush(int failed)
+{
+	if (!quiet_output)
+		return;
+
+	if (failed)
+	{
+		if (spool_fd >= 0)
+			replay_spool();
+		else
+			replay_tail();
+	}
+
+	ring_free(&tail);
+	if (spool_fd >= 0)
+		(void) close(spool_fd);
+	spool_fd = -1;
+	spool_size = 0;
+	quiet_output = 0;
+}
@@ -0,0 +1,248 @@
+/*
+  Copyright (C) 2026  agent <agent@local>
+
+  The chrootuid parent ring buffers for the hasher-priv program.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Code in this file may be executed with caller privileges. */
+
+/*
+ * The size of a ring is a power of two, head and tail are free running
+ * offsets, so that head - tail is the amount of data in the ring and
+ * offsets are mapped to the buffer by masking.
+ *
+ * A ring created with max_size above its initial size adapts to the
+ * source: it doubles each time a read fills all its free space, and
+ * halves back after a run of small reads into the empty ring.
+ */
+
+#include <errno.h>
+#include <error.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "priv.h"
+#include "xmalloc.h"
+
+#define	RING_SMALL_READS	16
+
+static size_t
+pow2_roundup(size_t size)
+{
+	size_t  n;
+
+	for (n = 1; n < size; n <<= 1)
+		;
+	return n;
+}
+
+void
+ring_init(ring_t *r, size_t size, size_t max_size)
+{
+	r->size = r->min_size = pow2_roundup(size);
+	r->max_size = max_size > size ? max_size : size;
+	r->buf = xmalloc(r->size);
+	r->head = r->tail = 0;
+	r->small_reads = 0;
+}
+
+/* Move the data to a buffer of SIZE bytes, SIZE is a power of two. */
+static void
+ring_resize(ring_t *r, size_t size)
+{
+	char   *buf = xmalloc(size);
+	size_t  len, used = ring_used(r);
+	char   *data = ring_data(r, &len);
+
+	memcpy(buf, data, len);
+	if (len < used)
+		memcpy(buf + len, r->buf, used - len);
+
+	free(r->buf);
+	r->buf = buf;
+	r->size = size;
+	r->tail = 0;
+	r->head = used;
+}
+
+static void
+ring_adapt(ring_t *r, size_t asked, size_t got, int was_empty)
+{
+	if (got == asked)
+	{
+		r->small_reads = 0;
+		if (r->size < r->max_size && 2 * r->size <= r->max_size)
+			ring_resize(r, 2 * r->size);
+	} else if (was_empty && got < r->size / 4)
+	{
+		if (++r->small_reads >= RING_SMALL_READS
+		    && r->size > r->min_size && 2 * ring_used(r) <= r->size)
+		{
+			r->small_reads = 0;
+			ring_resize(r, r->size / 2);
+		}
+	} else
+		r->small_reads = 0;
+}
+
+void
+ring_free(ring_t *r)
+{
+	free(r->buf);
+	memset(r, 0, sizeof(*r));
+}
+
+size_t
+ring_used(const ring_t *r)
+{
+	return r->head - r->tail;
+}
+
+size_t
+ring_space(const ring_t *r)
+{
+	return r->size - (r->head - r->tail);
+}
+
+/* Return the contiguous part of the data starting at the tail. */
+char   *
+ring_data(const ring_t *r, size_t *len)
+{
+	size_t  off = r->tail & (r->size - 1);
+	size_t  used = ring_used(r);
+
+	*len = (off + used > r->size) ? r->size - off : used;
+	return r->buf + off;
+}
+
+/* Describe the free space (or the data) as at most two iovecs. */
+static int
+ring_iov(const ring_t *r, size_t start, size_t len, struct iovec *iov)
+{
+	size_t  off = start & (r->size - 1);
+
+	iov[0].iov_base = r->buf + off;
+	if (off + len <= r->size)
+	{
+		iov[0].iov_len = len;
+		return 1;
+	}
+	iov[0].iov_len = r->size - off;
+	iov[1].iov_base = r->buf;
+	iov[1].iov_len = len - iov[0].iov_len;
+	return 2;
+}
+
+void
+ring_put(ring_t *r, const char *data, size_t len)
+{
+	struct iovec iov[2];
+	int     i, cnt;
+
+	if (len > ring_space(r))
+		error(EXIT_FAILURE, 0, "ring_put: %lu bytes do not fit",
+		      (unsigned long) len);
+
+	cnt = ring_iov(r, r->head, len, iov);
+	for (i = 0; i < cnt; ++i)
+	{
+		memcpy(iov[i].iov_base, data, iov[i].iov_len);
+		data += iov[i].iov_len;
+	}
+	r->head += len;
+}
+
+void
+ring_drop(ring_t *r, size_t len)
+{
+	r->tail += len;
+	if (r->tail == r->head)
+		r->head = r->tail = 0;
+}
+
+/* Read at most MAX bytes from FD to the free space with a single readv. */
+ssize_t
+ring_read_max(ring_t *r, int fd, size_t max)
+{
+	struct iovec iov[2];
+	size_t  space = ring_space(r), used = ring_used(r);
+	size_t  len = max < space ? max : space;
+	int     cnt = ring_iov(r, r->head, len, iov);
+	ssize_t n = TEMP_FAILURE_RETRY(readv(fd, iov, cnt));
+
+	if (n > 0)
+	{
+		r->head += (size_t) n;
+		/* A read cut short by MAX says nothing about the source. */
+		if (r->max_size > r->min_size && len == space)
+			ring_adapt(r, space, (size_t) n, !used);
+	}
+	return n;
+}
+
+/* Fill the free space of the ring from FD with a single readv. */
+ssize_t
+ring_read(ring_t *r, int fd)
+{
+	return ring_read_max(r, fd, ring_space(r));
+}
+
+/* Copy LEN bytes starting at the tail without consuming them. */
+void
+ring_peek(const ring_t *r, char *buf, size_t len)
+{
+	struct iovec iov[2];
+	int     i, cnt;
+
+	if (len > ring_used(r))
+		error(EXIT_FAILURE, 0, "ring_peek: %lu bytes are not there",
+		      (unsigned long) len);
+
+	cnt = ring_iov(r, r->tail, len, iov);
+	for (i = 0; i < cnt; ++i)
+	{
+		memcpy(buf, iov[i].iov_base, iov[i].iov_len);
+		buf += iov[i].iov_len;
+	}
+}
+
+/* Fill the free space of the ring from FD at OFFSET with a single preadv. */
+ssize_t
+ring_pread(ring_t *r, int fd, off_t offset)
+{
+	struct iovec iov[2];
+	int     cnt = ring_iov(r, r->head, ring_space(r), iov);
+	ssize_t n = TEMP_FAILURE_RETRY(preadv(fd, iov, cnt, offset));
+
+	if (n > 0)
+		r->head += (size_t) n;
+	return n;
+}
+
+/* Drain the ring to FD with a single writev. */
+ssize_t
+ring_write(ring_t *r, int fd)
+{
+	struct iovec iov[2];
+	int     cnt = ring_iov(r, r->tail, ring_used(r), iov);
+	ssize_t n = TEMP_FAILURE_RETRY(writev(fd, iov, cnt));
+
+	if (n > 0)
+		ring_drop(r, (size_t) n);
+	return n;
+}
@@ -0,0 +1,191 @@
+/*
+  Copyright (C) 2026  agent <agent@local>
+
+  The chrootuid parent relay statistics for the hasher-priv program.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * The relay keeps plain counters in relay_stats all the time; the report
+ * is written at exit if requested by relay_stats environment variable.
+ */
+
+#include <errno.h>
+#include <error.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "priv.h"
+
+relay_stats_t relay_stats;
+
+static int stats_fd = -1, stats_started;
+static unsigned long long stats_start_ns;
+
+static const char *const source_names[STATS_SOURCES] = {
+	"stdin", "stdout", "stderr", "syslog", "x11"
+};
+
+static const char *const sink_names[STATS_SINKS] = {
+	"stdout", "stderr"
+};
+
+/* This function may be executed with root privileges. */
+void
+stats_open(void)
+{
+	if (!relay_stats_dest)
+		return;
+
+	if (relay_stats_dest[0] == '/')
+		stats_fd = caller_open(relay_stats_dest,
+				       O_WRONLY | O_CREAT | O_TRUNC);
+	else
+		stats_fd = relay_stats_dest[0] - '0';
+
+	if (atexit(stats_report))
+		error(EXIT_FAILURE, errno, "atexit");
+}
+
+/* The code below may be executed with caller privileges. */
+
+unsigned long long
+stats_now(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		error(EXIT_FAILURE, errno, "clock_gettime");
+	return (unsigned long long) ts.tv_sec * 1000000000ULL +
+		(unsigned long long) ts.tv_nsec;
+}
+
+void
+stats_start(void)
+{
+	stats_start_ns = stats_now();
+	stats_started = 1;
+}
+
+static double
+seconds(unsigned long long ns)
+{
+	return (double) ns / 1e9;
+}
+
+static unsigned long long
+timeval_ns(const struct timeval *tv)
+{
+	return (unsigned long long) tv->tv_sec * 1000000000ULL +
+		(unsigned long long) tv->tv_usec * 1000ULL;
+}
+
+static void
+report_text(FILE *fp, unsigned long long wall, const struct rusage *ru)
+{
+	const relay_stats_t *s = &relay_stats;
+	int     i;
+
+	fprintf(fp, "relay: wall %.3fs user %.3fs sys %.3fs"
+		" wakeups %llu events %llu\n",
+		seconds(wall), seconds(timeval_ns(&ru->ru_utime)),
+		seconds(timeval_ns(&ru->ru_stime)), s->wakeups, s->events);
+
+	for (i = 0; i < STATS_SOURCES; ++i)
+		fprintf(fp, "relay: child %s: bytes %llu reads %llu"
+			" splices %llu\n", source_names[i],
+			s->source[i].bytes, s->source[i].reads,
+			s->source[i].splices);
+
+	for (i = 0; i < STATS_SINKS; ++i)
+		fprintf(fp, "relay: caller %s: bytes %llu writes %llu"
+			" max queued %llu backlog %.3fs blocked %.3fs\n",
+			sink_names[i], s->sink[i].bytes, s->sink[i].writes,
+			s->sink[i].queue_max, seconds(s->sink[i].backlog_ns),
+			seconds(s->sink[i].blocked_ns));
+
+	fprintf(fp, "relay: connections: x11 %lu log %lu\n",
+		s->x11_connections, s->log_connections);
+	fprintf(fp, "relay: log messages: filtered %llu suppressed %llu\n",
+		s->log_filtered, s->log_suppressed);
+}
+
+static void
+report_json(FILE *fp, unsigned long long wall, const struct rusage *ru)
+{
+	const relay_stats_t *s = &relay_stats;
+	int     i;
+
+	fprintf(fp, "{\"wall_ns\":%llu,\"user_ns\":%llu,\"sys_ns\":%llu,"
+		"\"wakeups\":%llu,\"events\":%llu,\"child\":{",
+		wall, timeval_ns(&ru->ru_utime), timeval_ns(&ru->ru_stime),
+		s->wakeups, s->events);
+
+	for (i = 0; i < STATS_SOURCES; ++i)
+		fprintf(fp, "%s\"%s\":{\"bytes\":%llu,\"reads\":%llu,"
+			"\"splices\":%llu}", i ? "," : "", source_names[i],
+			s->source[i].bytes, s->source[i].reads,
+			s->source[i].splices);
+
+	fputs("},\"caller\":{", fp);
+	for (i = 0; i < STATS_SINKS; ++i)
+		fprintf(fp, "%s\"%s\":{\"bytes\":%llu,\"writes\":%llu,"
+			"\"max_queued\":%llu,\"backlog_ns\":%llu,"
+			"\"blocked_ns\":%llu}", i ? "," : "", sink_names[i],
+			s->sink[i].bytes, s->sink[i].writes,
+			s->sink[i].queue_max, s->sink[i].backlog_ns,
+			s->sink[i].blocked_ns);
+
+	fprintf(fp, "},\"connections\":{\"x11\":%lu,\"log\":%lu},"
+		"\"log_messages\":{\"filtered\":%llu,\"suppressed\":%llu}}\n",
+		s->x11_connections, s->log_connections,
+		s->log_filtered, s->log_suppressed);
+}
+
+void
+stats_report(void)
+{
+	struct rusage ru;
+	char   *buf = 0;
+	size_t  len = 0;
+	FILE   *fp;
+
+	if (!stats_started || stats_fd < 0)
+		return;
+	stats_started = 0;
+
+	if (getrusage(RUSAGE_SELF, &ru) < 0)
+		error(EXIT_FAILURE, errno, "getrusage");
+
+	if (!(fp = open_memstream(&buf, &len)))
+		error(EXIT_FAILURE, errno, "open_memstream");
+	if (relay_stats_json)
+		report_json(fp, stats_now() - stats_start_ns, &ru);
+	else
+		report_text(fp, stats_now() - stats_start_ns, &ru);
+	if (fclose(fp))
+		error(EXIT_FAILURE, errno, "fclose");
+
+	if (write_loop(stats_fd, buf, len) != (ssize_t) len)
+	{
+		error(EXIT_SUCCESS, errno, "relay stats write");
+		fputc('\r', stderr);
+	}
+	free(buf);
+}
@@ -0,0 +1,600 @@
+/*
+  Copyright (C) 2026  agent <agent@local>
+
+  The chrootuid parent session transcript for the hasher-priv program.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Everything relayed to the caller is also appended to the transcript.
+ * The relay loop only copies the data to a memory buffer; a helper
+ * thread takes the whole buffer at once, compresses it if requested
+ * and writes it out, so neither compression nor the transcript file
+ * latency is seen by the relay.  What does not fit in the buffer while
+ * the helper thread is busy is spilled to an unlinked temporary file,
+ * the way caller output is queued, and newer data is appended there
+ * until the helper thread drains it, to keep the order.
+ *
+ * An indexed transcript is written by the relay itself through shared
+ * mappings of TRANSCRIPT_MAP_SIZE windows of the data and index files,
+ * which costs a copy to the page cache and no system call per chunk.
+ * File space is allocated a window ahead with fallocate(2), so that
+ * running out of disk space is reported instead of faulting on the
+ * mapping; where fallocate(2) is not supported, chunks are written
+ * with pwrite(2) instead.
+ */
+
+#include <errno.h>
+#include <error.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#if defined(ENABLE_TRANSCRIPT_ZLIB)
+# include <zlib.h>
+#elif defined(ENABLE_TRANSCRIPT_ZSTD)
+# include <zstd.h>
+#endif
+
+#include "priv.h"
+#include "transcript.h"
+#include "xmalloc.h"
+
+#define	TRANSCRIPT_BUF_SIZE	(1024 * 1024)
+#define	TRANSCRIPT_OUT_SIZE	(256 * 1024)
+#define	TRANSCRIPT_MAP_SIZE	(8 * 1024 * 1024)
+
+static int transcript_fd = -1, transcript_running, transcript_done;
+static int transcript_failed;
+
+static pthread_t transcript_thread;
+static pthread_mutex_t transcript_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t transcript_data = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t transcript_room = PTHREAD_COND_INITIALIZER;
+
+/* The relay fills one buffer while the helper thread writes the other. */
+static char *fill_buf, *work_buf;
+static size_t fill_len;
+
+/* The overflow of the fill buffer, also guarded by transcript_lock. */
+static int spill_fd = -1;
+static off_t spill_rd, spill_wr;
+
+#if defined(ENABLE_TRANSCRIPT_ZLIB)
+static z_stream zs;
+#elif defined(ENABLE_TRANSCRIPT_ZSTD)
+static ZSTD_CStream *zcs;
+#endif
+static char *out_buf;
+
+/* A file appended to through a window of shared mapping. */
+typedef struct
+{
+	int     fd;
+	char   *name;
+	char   *map;
+	unsigned long long map_start, size;
+	int     direct;		/* no fallocate, write without the mapping */
+} mfile_t;
+
+static mfile_t data_file = {.fd = -1 }, index_file = {.fd = -1 };
+
+/* Open the transcript before the process enters the chroot. */
+
+/* This function may be executed with root privileges. */
+void
+transcript_open(void)
+{
+	if (!transcript_path)
+		return;
+
+#if !defined(ENABLE_TRANSCRIPT_ZLIB) && !defined(ENABLE_TRANSCRIPT_ZSTD)
+	if (transcript_compress)
+		error(EXIT_FAILURE, 0,
+		      "transcript compression is not supported");
+#endif
+
+	if (transcript_index)
+	{
+		if (transcript_compress)
+			error(EXIT_FAILURE, 0,
+			      "transcript_index cannot be used together with transcript_compress");
+
+		/* Shared writable mappings need descriptors open for reading. */
+		transcript_fd = caller_open(transcript_path,
+					    O_RDWR | O_CREAT | O_TRUNC);
+		data_file.fd = transcript_fd;
+		data_file.name = xstrdup(transcript_path);
+		xasprintf(&index_file.name, "%s%s", transcript_path,
+			  TRANSCRIPT_INDEX_SUFFIX);
+		index_file.fd = caller_open(index_file.name,
+					    O_RDWR | O_CREAT | O_TRUNC);
+		return;
+	}
+
+	transcript_fd = caller_open(transcript_path,
+				    O_WRONLY | O_CREAT | O_TRUNC);
+}
+
+/* The code below may be executed with caller privileges. */
+
+static void
+sink_write(const char *data, size_t len)
+{
+	if (transcript_failed)
+		return;
+
+	if (write_loop(transcript_fd, data, len) != (ssize_t) len)
+	{
+		error(EXIT_SUCCESS, errno, "transcript: write: %s",
+		      transcript_path);
+		fputc('\r', stderr);
+		transcript_failed = 1;
+	}
+}
+
+#if defined(ENABLE_TRANSCRIPT_ZLIB)
+
+static void
+sink_init(void)
+{
+	if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+			 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		error(EXIT_FAILURE, 0, "transcript: deflateInit2 failed");
+	out_buf = xmalloc(TRANSCRIPT_OUT_SIZE);
+}
+
+static void
+sink_put(const char *data, size_t len, int finish)
+{
+	zs.next_in = (Bytef *) data;
+	zs.avail_in = (uInt) len;
+
+	for (;;)
+	{
+		int     rc;
+
+		zs.next_out = (Bytef *) out_buf;
+		zs.avail_out = TRANSCRIPT_OUT_SIZE;
+		rc = deflate(&zs, finish ? Z_FINISH : Z_NO_FLUSH);
+		if (rc == Z_STREAM_ERROR)
+			error(EXIT_FAILURE, 0, "transcript: deflate failed");
+		sink_write(out_buf, TRANSCRIPT_OUT_SIZE - zs.avail_out);
+		if (finish ? rc == Z_STREAM_END : zs.avail_out != 0)
+			break;
+	}
+
+	if (finish)
+		(void) deflateEnd(&zs);
+}
+
+#elif defined(ENABLE_TRANSCRIPT_ZSTD)
+
+static void
+sink_init(void)
+{
+	if (!(zcs = ZSTD_createCStream()))
+		error(EXIT_FAILURE, 0, "transcript: ZSTD_createCStream failed");
+	out_buf = xmalloc(TRANSCRIPT_OUT_SIZE);
+}
+
+static void
+sink_put(const char *data, size_t len, int finish)
+{
+	ZSTD_inBuffer in = { data, len, 0 };
+
+	for (;;)
+	{
+		ZSTD_outBuffer out = { out_buf, TRANSCRIPT_OUT_SIZE, 0 };
+		size_t  rc = ZSTD_compressStream2(zcs, &out, &in,
+						  finish ? ZSTD_e_end :
+						  ZSTD_e_continue);
+
+		if (ZSTD_isError(rc))
+			error(EXIT_FAILURE, 0, "transcript: %s",
+			      ZSTD_getErrorName(rc));
+		sink_write(out_buf, out.pos);
+		if (finish ? rc == 0 : in.pos == in.size)
+			break;
+	}
+
+	if (finish)
+		(void) ZSTD_freeCStream(zcs);
+}
+
+#else
+
+static void
+sink_init(void)
+{
+}
+
+static void
+sink_put(const char *data, size_t len,
+	 int __attribute__ ((unused)) finish)
+{
+	if (len)
+		sink_write(data, len);
+}
+
+#endif
+
+static void
+transcript_put(const char *data, size_t len, int finish)
+{
+	if (transcript_compress)
+		sink_put(data, len, finish);
+	else if (len)
+		sink_write(data, len);
+}
+
+static void
+mfile_failed(mfile_t *f, const char *what)
+{
+	error(EXIT_SUCCESS, errno, "transcript: %s: %s", what, f->name);
+	fputc('\r', stderr);
+	transcript_failed = 1;
+}
+
+/* Allocate and map the window starting at the current end of file. */
+static int
+mfile_map(mfile_t *f)
+{
+	if (f->map && munmap(f->map, TRANSCRIPT_MAP_SIZE) < 0)
+	{
+		f->map = 0;
+		mfile_failed(f, "munmap");
+		return -1;
+	}
+	f->map = 0;
+	f->map_start = f->size;
+
+	if (fallocate(f->fd, 0, (off_t) f->map_start, TRANSCRIPT_MAP_SIZE) < 0)
+	{
+		if (errno != EOPNOTSUPP)
+		{
+			mfile_failed(f, "fallocate");
+			return -1;
+		}
+		/* A sparse window could fault later, do not map it. */
+		f->direct = 1;
+		return 0;
+	}
+
+	f->map = mmap(0, TRANSCRIPT_MAP_SIZE, PROT_READ | PROT_WRITE,
+		      MAP_SHARED, f->fd, (off_t) f->map_start);
+	if (f->map == MAP_FAILED)
+	{
+		f->map = 0;
+		mfile_failed(f, "mmap");
+		return -1;
+	}
+
+	return 0;
+}
+
+static void
+mfile_put(mfile_t *f, const void *data, size_t len)
+{
+	while (len && !transcript_failed)
+	{
+		size_t  off, n;
+
+		if (!f->direct
+		    && (!f->map || f->size == f->map_start + TRANSCRIPT_MAP_SIZE)
+		    && mfile_map(f) < 0)
+			return;
+
+		if (f->direct)
+		{
+			ssize_t w = TEMP_FAILURE_RETRY(pwrite(f->fd, data, len,
+							      (off_t) f->size));
+
+			if (w <= 0)
+			{
+				if (!w)
+					errno = ENOSPC;
+				mfile_failed(f, "pwrite");
+				return;
+			}
+			f->size += (unsigned long long) w;
+			data = (const char *) data + w;
+			len -= (size_t) w;
+			continue;
+		}
+
+		off = (size_t) (f->size - f->map_start);
+		n = TRANSCRIPT_MAP_SIZE - off;
+
+		if (n > len)
+			n = len;
+		memcpy(f->map + off, data, n);
+		f->size += n;
+		data = (const char *) data + n;
+		len -= n;
+	}
+}
+
+/* Unmap the file and cut off the space allocated ahead. */
+static void
+mfile_close(mfile_t *f)
+{
+	if (f->map)
+		(void) munmap(f->map, TRANSCRIPT_MAP_SIZE);
+	f->map = 0;
+	if (ftruncate(f->fd, (off_t) f->size) < 0 && !transcript_failed)
+		mfile_failed(f, "ftruncate");
+	if (f != &data_file && close(f->fd) < 0 && !transcript_failed)
+		mfile_failed(f, "close");
+	f->fd = -1;
+	free(f->name);
+	f->name = 0;
+}
+
+static void
+put_be(unsigned char *p, uint64_t value, unsigned bytes)
+{
+	while (bytes--)
+	{
+		p[bytes] = (unsigned char) value;
+		value >>= 8;
+	}
+}
+
+static void
+index_start(void)
+{
+	unsigned char hdr[TRANSCRIPT_INDEX_ENTRY_SIZE];
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_REALTIME, &ts) < 0)
+		error(EXIT_FAILURE, errno, "clock_gettime");
+
+	memcpy(hdr, TRANSCRIPT_INDEX_MAGIC, 8);
+	put_be(hdr + 8, stats_now(), 8);
+	put_be(hdr + 16, (uint64_t) ts.tv_sec * 1000000000U +
+	       (uint64_t) ts.tv_nsec, 8);
+	mfile_put(&index_file, hdr, sizeof(hdr));
+}
+
+static void
+index_write(unsigned chan, const char *data, size_t count)
+{
+	unsigned char entry[TRANSCRIPT_INDEX_ENTRY_SIZE];
+
+	put_be(entry, data_file.size, 8);
+	entry[8] = (unsigned char) chan;
+	entry[9] = entry[10] = entry[11] = 0;
+	put_be(entry + 12, count, 4);
+	put_be(entry + 16, stats_now(), 8);
+
+	mfile_put(&data_file, data, count);
+	mfile_put(&index_file, entry, sizeof(entry));
+}
+
+/*
+ * Write out up to LEN bytes spilled at OFF; if they cannot be read back,
+ * the transcript is failed and the spilled data is dropped.
+ */
+static void
+spill_put(off_t off, size_t len)
+{
+	ssize_t n;
+
+	if (len > TRANSCRIPT_BUF_SIZE)
+		len = TRANSCRIPT_BUF_SIZE;
+	n = TEMP_FAILURE_RETRY(pread(spill_fd, work_buf, len, off));
+	if (n > 0)
+		transcript_put(work_buf, (size_t) n, 0);
+	else if (!transcript_failed)
+	{
+		error(EXIT_SUCCESS, n ? errno : 0, "transcript: pread");
+		fputc('\r', stderr);
+		transcript_failed = 1;
+	}
+
+	pthread_mutex_lock(&transcript_lock);
+	if (n > 0)
+		spill_rd += n;
+	else
+		spill_rd = spill_wr;
+	if (spill_rd == spill_wr)
+	{
+		(void) ftruncate(spill_fd, 0);
+		spill_rd = spill_wr = 0;
+	}
+	pthread_mutex_unlock(&transcript_lock);
+}
+
+static void *
+transcript_loop(void __attribute__ ((unused)) * arg)
+{
+	for (;;)
+	{
+		char   *buf;
+		size_t  len;
+
+		pthread_mutex_lock(&transcript_lock);
+		while (!fill_len && spill_rd == spill_wr && !transcript_done)
+			pthread_cond_wait(&transcript_data, &transcript_lock);
+		if (!fill_len)
+		{
+			/* The fill buffer is older than the spilled data. */
+			off_t   off = spill_rd;
+
+			len = (size_t) (spill_wr - spill_rd);
+			pthread_mutex_unlock(&transcript_lock);
+			if (!len)
+				break;
+			spill_put(off, len);
+			continue;
+		}
+		buf = fill_buf;
+		len = fill_len;
+		fill_buf = work_buf;
+		work_buf = buf;
+		fill_len = 0;
+		pthread_mutex_unlock(&transcript_lock);
+		pthread_cond_signal(&transcript_room);
+
+		transcript_put(buf, len, 0);
+	}
+
+	transcript_put(0, 0, 1);
+	return 0;
+}
+
+/* Start recording, return nonzero if the transcript is enabled. */
+int
+transcript_start(void)
+{
+	sigset_t set, saved;
+	int     rc;
+
+	if (transcript_fd < 0)
+		return 0;
+
+	if (transcript_index)
+	{
+		index_start();
+		transcript_running = 1;
+		if (atexit(transcript_finish))
+			error(EXIT_FAILURE, errno, "atexit");
+		return 1;
+	}
+
+	fill_buf = xmalloc(TRANSCRIPT_BUF_SIZE);
+	work_buf = xmalloc(TRANSCRIPT_BUF_SIZE);
+	if (transcript_compress)
+		sink_init();
+
+	/* Signals are for the relay loop only. */
+	sigfillset(&set);
+	pthread_sigmask(SIG_SETMASK, &set, &saved);
+	rc = pthread_create(&transcript_thread, 0, transcript_loop, 0);
+	pthread_sigmask(SIG_SETMASK, &saved, 0);
+	if (rc)
+		error(EXIT_FAILURE, rc, "pthread_create");
+
+	transcript_running = 1;
+	if (atexit(transcript_finish))
+		error(EXIT_FAILURE, errno, "atexit");
+
+	return 1;
+}
+
+void
+transcript_write(unsigned chan, const char *data, size_t count)
+{
+	if (!transcript_running)
+		return;
+
+	if (transcript_index)
+	{
+		index_write(chan, data, count);
+		return;
+	}
+
+	pthread_mutex_lock(&transcript_lock);
+	int     wake = !fill_len && spill_rd == spill_wr;
+
+	while (count)
+	{
+		if (spill_rd == spill_wr)
+		{
+			size_t  len = TRANSCRIPT_BUF_SIZE - fill_len;
+
+			if (len > count)
+				len = count;
+			memcpy(fill_buf + fill_len, data, len);
+			fill_len += len;
+			data += len;
+			count -= len;
+			if (!count)
+				break;
+		}
+
+		if (spill_fd < 0 && (spill_fd = spill_open()) < 0)
+		{
+			/* Nowhere to spill, wait for the helper thread. */
+			pthread_cond_signal(&transcript_data);
+			while (fill_len == TRANSCRIPT_BUF_SIZE)
+				pthread_cond_wait(&transcript_room,
+						  &transcript_lock);
+			continue;
+		}
+
+		ssize_t n = TEMP_FAILURE_RETRY(pwrite(spill_fd, data, count,
+						      spill_wr));
+
+		if (n <= 0)
+			error(EXIT_FAILURE, n ? errno : 0, "transcript: pwrite");
+		spill_wr += n;
+		data += n;
+		count -= (size_t) n;
+	}
+	pthread_mutex_unlock(&transcript_lock);
+
+	if (wake)
+		pthread_cond_signal(&transcript_data);
+}
+
+/* Write out everything recorded and close the transcript. */
+void
+transcript_finish(void)
+{
+	if (!transcript_running)
+		return;
+	transcript_running = 0;
+
+	if (transcript_index)
+	{
+		mfile_close(&index_file);
+		mfile_close(&data_file);
+	} else
+	{
+		pthread_mutex_lock(&transcript_lock);
+		transcript_done = 1;
+		pthread_mutex_unlock(&transcript_lock);
+		pthread_cond_signal(&transcript_data);
+
+		pthread_join(transcript_thread, 0);
+	}
+
+	if (close(transcript_fd) < 0 && !transcript_failed)
+	{
+		error(EXIT_SUCCESS, errno, "transcript: close: %s",
+		      transcript_path);
+		fputc('\r', stderr);
+	}
+	transcript_fd = -1;
+
+	if (spill_fd >= 0)
+		(void) close(spill_fd);
+	spill_fd = -1;
+	spill_rd = spill_wr = 0;
+
+	free(fill_buf);
+	free(work_buf);
+	free(out_buf);
+	fill_buf = work_buf = out_buf = 0;
+}
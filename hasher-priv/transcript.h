@@ -0,0 +1,49 @@
+/*
+  Copyright (C) 2026  agent <agent@local>
+
+  The indexed transcript format for the hasher-priv project.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PKG_BUILD_TRANSCRIPT_H
+#define PKG_BUILD_TRANSCRIPT_H
+
+/*
+ * An indexed transcript is a pair of files.  The data file is the plain
+ * concatenation of everything relayed, exactly like a non-indexed
+ * uncompressed transcript.  The index file, named after the data file
+ * with TRANSCRIPT_INDEX_SUFFIX appended, starts with a header followed
+ * by one entry per relayed chunk, in order.  All numbers are big-endian.
+ *
+ * Header, TRANSCRIPT_INDEX_ENTRY_SIZE bytes:
+ *	0	magic, TRANSCRIPT_INDEX_MAGIC
+ *	8	session start, CLOCK_MONOTONIC nanoseconds
+ *	16	session start, CLOCK_REALTIME nanoseconds
+ *
+ * Entry, TRANSCRIPT_INDEX_ENTRY_SIZE bytes:
+ *	0	chunk offset in the data file
+ *	8	channel, as in framed output
+ *	9	reserved, zero
+ *	12	chunk length
+ *	16	chunk time, CLOCK_MONOTONIC nanoseconds
+ *
+ * Entry times never decrease, so the index can be searched by time.
+ */
+
+#define	TRANSCRIPT_INDEX_SUFFIX		".idx"
+#define	TRANSCRIPT_INDEX_MAGIC		"HPTIDX01"
+#define	TRANSCRIPT_INDEX_ENTRY_SIZE	24
+
+#endif /* PKG_BUILD_TRANSCRIPT_H */
@@ -59,6 +59,9 @@ init_tty(void)
 
 		cfmakeraw(&tty_changed);
 		tty_changed.c_iflag |= IXON;
+		/* Output from pipes is not processed by the pty, do it here. */
+		if (use_pty_stdin)
+			tty_changed.c_oflag = tty_orig.c_oflag;
 		tty_changed.c_cc[VMIN] = 1;
 		tty_changed.c_cc[VTIME] = 0;
 
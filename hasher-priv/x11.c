@@ -44,7 +44,7 @@ static unsigned long x11_connect_port;
 /* This function may be executed with caller or child privileges. */
 
 static int
-unix_listen(const char *dir_name, const char *file_name)
+unix_listen(const char *dir_name, const char *file_name, int type)
 {
 	struct sockaddr_un sun;
 
@@ -67,7 +67,7 @@ unix_listen(const char *dir_name, const char *file_name)
 
 	int     fd;
 
-	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+	if ((fd = socket(AF_UNIX, type, 0)) < 0)
 	{
 		error(EXIT_SUCCESS, errno, "socket AF_UNIX");
 		return -1;
@@ -80,7 +80,7 @@ unix_listen(const char *dir_name, const char *file_name)
 		return -1;
 	}
 
-	if (listen(fd, 16) < 0)
+	if (type == SOCK_STREAM && listen(fd, 16) < 0)
 	{
 		error(EXIT_SUCCESS, errno, "listen: %s", sun.sun_path);
 		(void) close(fd);
@@ -95,7 +95,19 @@ unix_listen(const char *dir_name, const char *file_name)
 int
 log_listen(void)
 {
-	int     fd = unix_listen("/dev", "log");
+	int     fd = -1, on = 1;
+
+	/* Clients fall back to a stream socket, but not the other way. */
+	if (log_dgram)
+		fd = unix_listen("/dev", "log", SOCK_DGRAM);
+
+	/* Rate limits need the credentials of datagram senders. */
+	if (fd >= 0 && log_rate
+	    && setsockopt(fd, SOL_SOCKET, SO_PASSCRED, &on, sizeof(on)))
+		error(EXIT_SUCCESS, errno, "setsockopt SO_PASSCRED");
+
+	if (fd < 0)
+		fd = unix_listen("/dev", "log", SOCK_STREAM);
 
 	if (fd >= 0 && chmod("/dev/log", 0622))
 	{
@@ -107,12 +119,57 @@ log_listen(void)
 	return fd;
 }
 
+/* This function may be executed with caller privileges. */
+
+int
+journal_listen(void)
+{
+	static const char *const dirs[] = {
+		"/run", "/run/systemd", "/run/systemd/journal"
+	};
+	size_t  i;
+	int     fd, on = 1;
+
+	if (!journal_socket)
+		return -1;
+
+	/* Unlike /dev, these directories may be missing. */
+	for (i = 0; i < sizeof(dirs) / sizeof(dirs[0]); ++i)
+	{
+		if (!mkdir(dirs[i], 0755))
+			(void) chmod(dirs[i], 0755);
+		else if (errno != EEXIST)
+		{
+			error(EXIT_SUCCESS, errno, "mkdir: %s", dirs[i]);
+			return -1;
+		}
+	}
+
+	fd = unix_listen("/run/systemd/journal", "socket", SOCK_DGRAM);
+	if (fd < 0)
+		return -1;
+
+	/* The sender is the process the entry comes from. */
+	if (setsockopt(fd, SOL_SOCKET, SO_PASSCRED, &on, sizeof(on)))
+		error(EXIT_SUCCESS, errno, "setsockopt SO_PASSCRED");
+
+	if (chmod("/run/systemd/journal/socket", 0622))
+	{
+		error(EXIT_SUCCESS, errno, "chmod: %s",
+		      "/run/systemd/journal/socket");
+		(void) close(fd);
+		fd = -1;
+	}
+
+	return fd;
+}
+
 /* This function may be executed with child privileges. */
 
 int
 x11_listen(void)
 {
-	return unix_listen(X11_UNIX_DIR, "X10");
+	return unix_listen(X11_UNIX_DIR, "X10", SOCK_STREAM);
 }
 
 static int x11_dir_fd = -1;
@@ -249,7 +306,7 @@ unix_accept(int fd)
 
 	int     rc = accept(fd, (struct sockaddr *) &sun, &len);
 
-	if (rc < 0)
+	if (rc < 0 && errno != EAGAIN)
 	{
 		error(EXIT_SUCCESS, errno, "accept");
 		fputc('\r', stderr);